@@ -19,6 +19,7 @@
 
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "lwan.h"
@@ -54,6 +55,27 @@ gif_beacon(struct lwan_request *request __attribute__((unused)),
     return HTTP_OK;
 }
 
+enum lwan_http_status
+test_get_header(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    const char *name = lwan_request_get_query_param(request, "name");
+    const char *value;
+
+    if (!name)
+        return HTTP_BAD_REQUEST;
+
+    value = lwan_request_get_header(request, name);
+    if (!value)
+        return HTTP_NOT_FOUND;
+
+    response->mime_type = "text/plain";
+    strbuf_set(response->buffer, value, strlen(value));
+
+    return HTTP_OK;
+}
+
 enum lwan_http_status
 test_chunked_encoding(struct lwan_request *request,
             struct lwan_response *response,
@@ -77,6 +99,59 @@ test_chunked_encoding(struct lwan_request *request,
     return HTTP_OK;
 }
 
+enum lwan_http_status
+test_many_chunks(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    response->mime_type = "text/plain";
+
+    for (int i = 0; i < 2000; i++) {
+        strbuf_printf(response->buffer, "%d,", i);
+        lwan_response_send_chunk(request);
+    }
+
+    return HTTP_OK;
+}
+
+enum lwan_http_status
+test_big_response(struct lwan_request *request __attribute__((unused)),
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    const size_t size = 4 * 1024 * 1024;
+
+    response->mime_type = "application/octet-stream";
+
+    if (!strbuf_grow_to(response->buffer, size))
+        return HTTP_INTERNAL_ERROR;
+
+    for (size_t i = 0; i < size; i++)
+        strbuf_append_char(response->buffer, (char)('a' + i % 26));
+
+    return HTTP_OK;
+}
+
+enum lwan_http_status
+thread_stats(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    const struct lwan *l = request->conn->thread->lwan;
+    struct lwan_thread_stats stats;
+
+    response->mime_type = "text/plain";
+
+    for (int i = 0; lwan_get_thread_stats(l, i, &stats); i++) {
+        strbuf_append_printf(response->buffer,
+            "thread %d: live %u, accepted %lu, migrated %lu\n", i,
+            stats.live_connections, stats.accepted_connections,
+            stats.migrated_connections);
+    }
+
+    return HTTP_OK;
+}
+
 enum lwan_http_status
 test_server_sent_event(struct lwan_request *request,
             struct lwan_response *response,
@@ -92,6 +167,40 @@ test_server_sent_event(struct lwan_request *request,
     return HTTP_OK;
 }
 
+/* A few events followed by one larger than the socket buffers.  Each of
+ * the first ones waits for a byte of the request body, so the client
+ * decides how far apart they are. */
+enum lwan_http_status
+test_slow_event_stream(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    const size_t size = 4 * 1024 * 1024;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        char c;
+
+        strbuf_printf(response->buffer, "Current value is %d", i);
+        lwan_response_send_event(request, "currval");
+        lwan_response_flush(request);
+
+        if (lwan_request_read_body(request, &c, 1) != 1)
+            return HTTP_BAD_REQUEST;
+    }
+
+    if (!strbuf_grow_to(response->buffer, size))
+        return HTTP_INTERNAL_ERROR;
+    for (size_t j = 0; j < size; j++)
+        strbuf_append_char(response->buffer, (char)('a' + j % 26));
+    lwan_response_send_event(request, "big");
+
+    strbuf_printf(response->buffer, "That's all");
+    lwan_response_send_event(request, "done");
+
+    return HTTP_OK;
+}
+
 enum lwan_http_status
 test_proxy(struct lwan_request *request,
            struct lwan_response *response,
@@ -173,6 +282,88 @@ test_post_big(struct lwan_request *request, struct lwan_response *response,
     return HTTP_OK;
 }
 
+enum lwan_http_status
+test_post_stream(struct lwan_request *request, struct lwan_response *response,
+    void *data __attribute__((unused)))
+{
+    char buffer[1000];
+    size_t received = 0, sum = 0;
+    ssize_t n;
+
+    while ((n = lwan_request_read_body(request, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            sum += (size_t)buffer[i];
+        received += (size_t)n;
+    }
+    if (n < 0)
+        return HTTP_BAD_REQUEST;
+
+    response->mime_type = "application/json";
+    strbuf_printf(response->buffer, "{\"received\": %zu, \"sum\": %zu}",
+        received, sum);
+
+    return HTTP_OK;
+}
+
+enum lwan_http_status
+test_post_upload(struct lwan_request *request, struct lwan_response *response,
+    void *data __attribute__((unused)))
+{
+    const struct lwan_multipart_file *file;
+    const char *field;
+    size_t sum = 0;
+
+    field = lwan_request_get_post_param(request, "field");
+    file = lwan_request_get_post_file(request, "file");
+    if (!field || !file)
+        return HTTP_BAD_REQUEST;
+
+    if (file->fd >= 0) {
+        unsigned char buffer[1000];
+        off_t offset = 0;
+        ssize_t n;
+
+        while ((n = pread(file->fd, buffer, sizeof(buffer), offset)) > 0) {
+            for (ssize_t i = 0; i < n; i++)
+                sum += buffer[i];
+            offset += n;
+        }
+        if (n < 0 || offset != file->size)
+            return HTTP_INTERNAL_ERROR;
+    } else {
+        for (size_t i = 0; i < file->contents.len; i++)
+            sum += (unsigned char)file->contents.value[i];
+    }
+
+    response->mime_type = "application/json";
+    strbuf_printf(response->buffer, "{\"field\": \"%s\", \"filename\": \"%s\", "
+        "\"content_type\": \"%s\", \"size\": %zu, \"sum\": %zu}",
+        field, file->filename, file->content_type, (size_t)file->size, sum);
+
+    return HTTP_OK;
+}
+
+enum lwan_http_status
+test_huge_headers(struct lwan_request *request __attribute__((unused)),
+    struct lwan_response *response, void *data __attribute__((unused)))
+{
+    static char policy[3000];
+    static struct lwan_key_value headers[] = {
+        { .key = "Content-Security-Policy", .value = policy },
+        { .key = "Set-Cookie", .value = "trololo=1" },
+        { NULL, NULL }
+    };
+
+    if (!policy[0])
+        memset(policy, 'x', sizeof(policy) - 1);
+
+    response->headers = headers;
+    response->mime_type = "text/plain";
+    strbuf_set_static(response->buffer, "Huge headers", sizeof("Huge headers") - 1);
+
+    return HTTP_OK;
+}
+
 enum lwan_http_status
 hello_world(struct lwan_request *request,
             struct lwan_response *response,
@@ -198,17 +389,18 @@ hello_world(struct lwan_request *request,
     strbuf_append_str(response->buffer, "\n\nCookies\n", 0);
     strbuf_append_str(response->buffer, "-------\n\n", 0);
 
-    struct lwan_key_value *qs = request->cookies.base.base;
-    for (; qs && qs->key; qs++)
+    const struct lwan_key_value_list *vars = lwan_request_get_cookies(request);
+    for (unsigned int i = 0; i < vars->len; i++)
         strbuf_append_printf(response->buffer,
-                    "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
+                    "Key = \"%s\"; Value = \"%s\"\n", vars->base[i].key, vars->base[i].value);
 
     strbuf_append_str(response->buffer, "\n\nQuery String Variables\n", 0);
     strbuf_append_str(response->buffer, "----------------------\n\n", 0);
 
-    for (qs = request->query_params.base.base; qs && qs->key; qs++)
+    vars = lwan_request_get_query_params(request);
+    for (unsigned int i = 0; i < vars->len; i++)
         strbuf_append_printf(response->buffer,
-                    "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
+                    "Key = \"%s\"; Value = \"%s\"\n", vars->base[i].key, vars->base[i].value);
 
     if (lwan_request_get_method(request) != REQUEST_METHOD_POST)
         goto end;
@@ -216,20 +408,30 @@ hello_world(struct lwan_request *request,
     strbuf_append_str(response->buffer, "\n\nPOST data\n", 0);
     strbuf_append_str(response->buffer, "---------\n\n", 0);
 
-    for (qs = request->post_data.base.base; qs && qs->key; qs++)
+    vars = lwan_request_get_post_params(request);
+    for (unsigned int i = 0; i < vars->len; i++)
         strbuf_append_printf(response->buffer,
-                    "Key = \"%s\"; Value = \"%s\"\n", qs->key, qs->value);
+                    "Key = \"%s\"; Value = \"%s\"\n", vars->base[i].key, vars->base[i].value);
 
 end:
     return HTTP_OK;
 }
 
 int
-main()
+main(int argc, char *argv[])
 {
     struct lwan l;
 
-    lwan_init(&l);
+    if (argc > 1) {
+        /* Some tests need settings that can't be used with the others */
+        struct lwan_config c = *lwan_get_default_config();
+
+        c.config_file_path = strdup(argv[1]);
+        lwan_init_with_config(&l, &c);
+    } else {
+        lwan_init(&l);
+    }
+
     lwan_main_loop(&l);
     lwan_shutdown(&l);
 
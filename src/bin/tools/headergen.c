@@ -0,0 +1,120 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/lwan-header-hash.h"
+
+#define MAX_HEADERS 256
+#define MAX_SEEDS (1 << 20)
+
+static char *names[MAX_HEADERS];
+static size_t n_names;
+
+static bool try_seed(uint32_t seed, uint32_t table_size, int *slots)
+{
+    memset(slots, -1, sizeof(int) * table_size);
+
+    for (size_t i = 0; i < n_names; i++) {
+        uint32_t slot = lwan_header_hash(names[i], strlen(names[i]), seed) &
+                            (table_size - 1);
+
+        if (slots[slot] >= 0)
+            return false;
+        slots[slot] = (int)i;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    char line[256];
+    FILE *fp;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s /path/to/known-headers.txt\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "re");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *end = line + strcspn(line, " \t\r\n#");
+
+        if (end == line)
+            continue;
+        if (n_names == MAX_HEADERS) {
+            fprintf(stderr, "Too many headers\n");
+            return 1;
+        }
+
+        *end = '\0';
+        names[n_names++] = strdup(line);
+    }
+    fclose(fp);
+
+    /* Find the smallest table (and a seed for it) with no collisions */
+    for (uint32_t table_size = 16; table_size <= 4096; table_size *= 2) {
+        int *slots;
+
+        if (table_size < n_names)
+            continue;
+
+        slots = malloc(sizeof(int) * table_size);
+        if (!slots)
+            return 1;
+
+        for (uint32_t seed = 1; seed < MAX_SEEDS; seed++) {
+            if (!try_seed(seed, table_size, slots))
+                continue;
+
+            printf("/* Auto generated by %s, do not edit. */\n", argv[0]);
+            printf("#pragma once\n\n");
+            printf("#define HEADER_HASH_SEED %#xu\n", seed);
+            printf("#define HEADER_TABLE_SIZE %u\n\n", table_size);
+            printf("static const struct {\n");
+            printf("    const char *name;\n");
+            printf("    unsigned int len;\n");
+            printf("} header_table[HEADER_TABLE_SIZE] = {\n");
+            for (uint32_t slot = 0; slot < table_size; slot++) {
+                if (slots[slot] < 0)
+                    continue;
+                printf("    [%u] = { \"%s\", %zu },\n", slot, names[slots[slot]],
+                    strlen(names[slots[slot]]));
+            }
+            printf("};\n");
+
+            free(slots);
+            return 0;
+        }
+
+        free(slots);
+    }
+
+    fprintf(stderr, "Could not find a perfect hash\n");
+    return 1;
+}
@@ -26,15 +26,19 @@
 #cmakedefine HAS_MEMRCHR
 #cmakedefine HAS_PIPE2
 #cmakedefine HAS_PTHREADBARRIER
+#cmakedefine HAS_PTHREAD_SETAFFINITY_NP
 #cmakedefine HAS_RAWMEMCHR
 #cmakedefine HAS_READAHEAD
 #cmakedefine HAS_REALLOCARRAY
 #cmakedefine HAS_MKOSTEMP
+#cmakedefine HAS_EVENTFD
+#cmakedefine HAS_SPLICE
 
 /* Compiler builtins for specific CPU instruction support */
 #cmakedefine HAVE_BUILTIN_CLZLL
 #cmakedefine HAVE_BUILTIN_CPU_INIT
 #cmakedefine HAVE_BUILTIN_IA32_CRC32
+#cmakedefine HAVE_AVX2_TARGET
 #cmakedefine HAVE_BUILTIN_MUL_OVERFLOW
 #cmakedefine HAVE_BUILTIN_ADD_OVERFLOW
 
@@ -44,6 +48,12 @@
 /* Libraries */
 #cmakedefine HAVE_LUA
 
+/* Linux io_uring */
+#cmakedefine HAVE_IO_URING
+
+/* Linux zero-copy sends */
+#cmakedefine HAVE_MSG_ZEROCOPY
+
 /* Valgrind support for coroutines */
 #cmakedefine USE_VALGRIND
 
@@ -282,6 +282,19 @@ destroy_entry:
     }
 }
 
+/* Takes another reference to an entry that's already referenced.  Fails
+ * for TEMPORARY entries, as these are destroyed on the first unref.  */
+bool cache_entry_try_ref(struct cache_entry *entry)
+{
+    assert(entry);
+
+    if (entry->flags & TEMPORARY)
+        return false;
+
+    ATOMIC_INC(entry->refs);
+    return true;
+}
+
 static bool cache_pruner_job(void *data)
 {
     struct cache *cache = data;
@@ -48,5 +48,6 @@ void cache_destroy(struct cache *cache);
 struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
       const char *key, int *error);
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry);
+bool cache_entry_try_ref(struct cache_entry *entry);
 struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
       struct coro *coro, const char *key);
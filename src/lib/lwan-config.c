@@ -22,6 +22,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -36,6 +38,10 @@
 #include "lwan-config.h"
 #include "strbuf.h"
 
+#if !defined(CPU_SETSIZE)
+#define CPU_SETSIZE 1024
+#endif
+
 enum lexeme_type {
     LEXEME_ERROR,
     LEXEME_STRING,
@@ -157,6 +163,66 @@ int parse_int(const char *value, int default_value)
     return (int)long_value;
 }
 
+int parse_cpu_list(const char *value, unsigned int *cpus, int max_cpus)
+{
+    int n_cpus = 0;
+
+    /* Accepts lists such as "0-3,8,10-11".  If cpus is NULL, only
+     * validates and counts them.  */
+    while (*value) {
+        unsigned long first, last;
+        char *endptr;
+
+        while (isspace(*value))
+            value++;
+        if (!isdigit(*value))
+            return -1;
+
+        errno = 0;
+        first = last = strtoul(value, &endptr, 10);
+        if (errno != 0)
+            return -1;
+        value = endptr;
+
+        if (*value == '-') {
+            value++;
+            if (!isdigit(*value))
+                return -1;
+
+            last = strtoul(value, &endptr, 10);
+            if (errno != 0 || last < first)
+                return -1;
+            value = endptr;
+        }
+
+        /* CPUs that don't fit in a cpu_set_t can't be used for
+         * affinity anyway; this also bounds the range below.  */
+        if (last >= CPU_SETSIZE)
+            return -1;
+
+        if (!cpus) {
+            if (last - first + 1 > (unsigned long)(INT_MAX - n_cpus))
+                return -1;
+            n_cpus += (int)(last - first + 1);
+        } else {
+            for (; first <= last; first++) {
+                if (n_cpus == max_cpus)
+                    return -1;
+                cpus[n_cpus++] = (unsigned int)first;
+            }
+        }
+
+        while (isspace(*value))
+            value++;
+        if (*value == ',')
+            value++;
+        else if (*value)
+            return -1;
+    }
+
+    return n_cpus;
+}
+
 bool parse_bool(const char *value, bool default_value)
 {
     if (!value)
@@ -62,3 +62,4 @@ bool parse_bool(const char *value, bool default_value);
 long parse_long(const char *value, long default_value);
 int parse_int(const char *value, int default_value);
 unsigned int parse_time_period(const char *str, unsigned int default_value);
+int parse_cpu_list(const char *value, unsigned int *cpus, int max_cpus);
@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "lwan-private.h"
 
@@ -61,8 +63,115 @@ struct coro {
 #endif
 
     bool ended;
+
+    /* Fields below aren't accessed from assembly; keep them here. */
+    unsigned char *stack;       /* Guard page is right below this */
+    size_t stack_size;
+    struct coro *next_free;
 };
 
+/* Stacks are mmap()ed with a PROT_NONE guard page below them, so that an
+ * overflow faults instead of silently corrupting memory.  The coro struct
+ * itself lives at the top of the mapping.  Each thread keeps the stacks of
+ * finished coroutines in a freelist, up to a limit, so they can be reused
+ * without going through the kernel again.  */
+static size_t coro_page_size;
+static size_t coro_mapping_size;
+static unsigned int coro_pool_max = 64;
+
+static __thread struct {
+    struct coro *free;
+    unsigned int count;
+} coro_pool;
+
+static void
+coro_pool_set_mapping_size(size_t stack_size)
+{
+    coro_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    coro_mapping_size = coro_page_size +
+        ((stack_size + sizeof(struct coro) + coro_page_size - 1) & ~(coro_page_size - 1));
+}
+
+void
+coro_pool_set_limits(size_t stack_size, unsigned int max_cached)
+{
+    if (stack_size < CORO_STACK_MIN) {
+        if (stack_size)
+            lwan_status_warning("Coroutine stack size must be at least %zu bytes",
+                (size_t)CORO_STACK_MIN);
+        stack_size = CORO_STACK_MIN;
+    }
+
+    coro_pool_set_mapping_size(stack_size);
+    coro_pool_max = max_cached;
+}
+
+static struct coro *
+coro_alloc(void)
+{
+    struct coro *coro = coro_pool.free;
+    unsigned char *mapping;
+
+    if (LIKELY(coro)) {
+        coro_pool.free = coro->next_free;
+        coro_pool.count--;
+        return coro;
+    }
+
+    if (UNLIKELY(!coro_mapping_size))
+        coro_pool_set_mapping_size(CORO_STACK_MIN);
+
+    mapping = mmap(NULL, coro_mapping_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (UNLIKELY(mapping == MAP_FAILED))
+        return NULL;
+
+    if (UNLIKELY(mprotect(mapping, coro_page_size, PROT_NONE) < 0)) {
+        munmap(mapping, coro_mapping_size);
+        return NULL;
+    }
+
+    coro = (struct coro *)(((uintptr_t)mapping + coro_mapping_size -
+        sizeof(*coro)) & ~(uintptr_t)0xf);
+    coro->stack = mapping + coro_page_size;
+    coro->stack_size = (size_t)((unsigned char *)coro - coro->stack);
+
+    if (UNLIKELY(coro_defer_array_init(&coro->defer) < 0)) {
+        munmap(mapping, coro_mapping_size);
+        return NULL;
+    }
+
+#if !defined(NDEBUG) && defined(USE_VALGRIND)
+    coro->vg_stack_id = VALGRIND_STACK_REGISTER(coro->stack,
+        coro->stack + coro->stack_size);
+#endif
+
+    return coro;
+}
+
+static void
+coro_unmap(struct coro *coro)
+{
+#if !defined(NDEBUG) && defined(USE_VALGRIND)
+    VALGRIND_STACK_DEREGISTER(coro->vg_stack_id);
+#endif
+    coro_defer_array_reset(&coro->defer);
+    munmap(coro->stack - coro_page_size, coro_mapping_size);
+}
+
+void
+coro_pool_drain(void)
+{
+    while (coro_pool.free) {
+        struct coro *coro = coro_pool.free;
+
+        coro_pool.free = coro->next_free;
+        coro_unmap(coro);
+    }
+
+    coro_pool.count = 0;
+}
+
 #if defined(__APPLE__)
 #define ASM_SYMBOL(name_) "_" #name_
 #else
@@ -195,12 +304,12 @@ coro_deferred_get_generation(const struct coro *coro)
 void
 coro_reset(struct coro *coro, coro_function_t func, void *data)
 {
-    unsigned char *stack = (unsigned char *)(coro + 1);
+    unsigned char *stack = coro->stack;
 
     coro->ended = false;
 
+    /* Storage for the deferred calls is kept for the next user */
     coro_deferred_run(coro, 0);
-    coro_defer_array_reset(&coro->defer);
 
 #if defined(__x86_64__)
     /* coro_entry_point() for x86-64 has 3 arguments, but RDX isn't
@@ -215,10 +324,10 @@ coro_reset(struct coro *coro, coro_function_t func, void *data)
     /* Ensure stack is properly aligned: it should be aligned to a
      * 16-bytes boundary so SSE will work properly, but should be
      * aligned on an 8-byte boundary right after calling a function. */
-    uintptr_t rsp = (uintptr_t) stack + CORO_STACK_MIN;
+    uintptr_t rsp = (uintptr_t) stack + coro->stack_size;
     coro->context[9 /* RSP */] = (rsp & ~0xful) - 0x8ul;
 #elif defined(__i386__)
-    stack = (unsigned char *)(uintptr_t)(stack + CORO_STACK_MIN);
+    stack = (unsigned char *)(uintptr_t)(stack + coro->stack_size);
 
     /* Make room for 3 args */
     stack -= sizeof(uintptr_t) * 3;
@@ -237,7 +346,7 @@ coro_reset(struct coro *coro, coro_function_t func, void *data)
     getcontext(&coro->context);
 
     coro->context.uc_stack.ss_sp = stack;
-    coro->context.uc_stack.ss_size = CORO_STACK_MIN;
+    coro->context.uc_stack.ss_size = coro->stack_size;
     coro->context.uc_stack.ss_flags = 0;
     coro->context.uc_link = NULL;
 
@@ -249,23 +358,13 @@ coro_reset(struct coro *coro, coro_function_t func, void *data)
 ALWAYS_INLINE struct coro *
 coro_new(struct coro_switcher *switcher, coro_function_t function, void *data)
 {
-    struct coro *coro = malloc(sizeof(*coro) + CORO_STACK_MIN);
+    struct coro *coro = coro_alloc();
     if (UNLIKELY(!coro))
         return NULL;
 
-    if (UNLIKELY(coro_defer_array_init(&coro->defer) < 0)) {
-        free(coro);
-        return NULL;
-    }
-
     coro->switcher = switcher;
     coro_reset(coro, function, data);
 
-#if !defined(NDEBUG) && defined(USE_VALGRIND)
-    char *stack = (char *)(coro + 1);
-    coro->vg_stack_id = VALGRIND_STACK_REGISTER(stack, stack + CORO_STACK_MIN);
-#endif
-
     return coro;
 }
 
@@ -319,12 +418,16 @@ void
 coro_free(struct coro *coro)
 {
     assert(coro);
-#if !defined(NDEBUG) && defined(USE_VALGRIND)
-    VALGRIND_STACK_DEREGISTER(coro->vg_stack_id);
-#endif
+
     coro_deferred_run(coro, 0);
-    coro_defer_array_reset(&coro->defer);
-    free(coro);
+
+    if (coro_pool.count < coro_pool_max) {
+        coro->next_free = coro_pool.free;
+        coro_pool.free = coro;
+        coro_pool.count++;
+    } else {
+        coro_unmap(coro);
+    }
 }
 
 static void
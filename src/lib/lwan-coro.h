@@ -45,6 +45,9 @@ void	coro_free(struct coro *coro);
 
 void    coro_reset(struct coro *coro, coro_function_t func, void *data);
 
+void    coro_pool_set_limits(size_t stack_size, unsigned int max_cached);
+void    coro_pool_drain(void);
+
 int	coro_resume(struct coro *coro);
 int	coro_resume_value(struct coro *coro, int value);
 int	coro_yield(struct coro *coro, int value);
@@ -0,0 +1,39 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Case-insensitive (for header names) FNV-1a hash.  Shared by headergen,
+ * which finds a seed that makes it a perfect hash for the well-known
+ * header names, and the request parser.  */
+static inline uint32_t
+lwan_header_hash(const char *name, size_t len, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint32_t)(unsigned char)(name[i] | 0x20);
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
@@ -17,40 +17,202 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 
-#include "lwan.h"
+#if defined(HAVE_MSG_ZEROCOPY)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "lwan-private.h"
 #include "lwan-io-wrappers.h"
 
-static const int MAX_FAILED_TRIES = 5;
+#if defined(HAVE_IO_URING)
+#include "lwan-uring.h"
+#endif
 
-ssize_t
-lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
+/* Writes have no deadline of their own: the connection is in the write
+ * phase, and write_timeout is counted from the last time some progress
+ * was made.  Clients that accept data, but too slowly, are cut off by the
+ * rate they make room in the socket buffer while a response waits for it;
+ * time spent producing the response (e.g. between events of a stream)
+ * doesn't count.  */
+static void
+begin_write(struct lwan_request *request)
+{
+    struct lwan_response_batch *batch = request->batch;
+
+    if ((request->conn->flags & CONN_PHASE_MASK) == CONN_PHASE_WRITE)
+        return;
+
+    lwan_connection_set_phase(request->conn, CONN_PHASE_WRITE);
+    if (LIKELY(batch)) {
+        batch->blocked_ms = 0;
+        batch->drained = 0;
+        batch->has_blocked = false;
+    }
+}
+
+static ALWAYS_INLINE void
+wrote(struct lwan_request *request, size_t len)
+{
+    /* Moves the write deadline */
+    request->conn->flags |= CONN_PHASE_CHANGED;
+    if (LIKELY(request->batch) && request->batch->has_blocked)
+        request->batch->drained += len;
+}
+
+static uint64_t
+monotonic_ms(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        lwan_status_critical_perror("clock_gettime");
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void
+wait_until_writable(struct lwan_request *request)
+{
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    struct lwan_response_batch *batch = request->batch;
+    uint64_t started;
+
+    if (UNLIKELY(!batch)) {
+        request->conn->flags &= ~CONN_WRITABLE;
+        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        return;
+    }
+
+    if (config->min_write_rate &&
+            batch->blocked_ms > (uint64_t)config->write_timeout * 1000 &&
+            batch->drained * 1000 / batch->blocked_ms < config->min_write_rate) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    /* Resumed once the poller says the socket is writable again */
+    started = monotonic_ms();
+    batch->has_blocked = true;
+    request->conn->flags &= ~CONN_WRITABLE;
+    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+    batch->blocked_ms += monotonic_ms() - started;
+}
+
+#if defined(HAVE_IO_URING)
+/* With the io_uring backend, socket I/O is queued in the thread's ring and
+ * submitted by the same system call the I/O loop uses to wait for events;
+ * the coroutine is resumed with the result once the request completes,
+ * instead of being told about readiness and retrying.  Results are turned
+ * into what the equivalent system call would return.  Sends aren't left
+ * waiting in the kernel once the socket buffer is full: they fail with
+ * EAGAIN, so that waiting for room is accounted for like with epoll.  */
+static ALWAYS_INLINE struct lwan_uring *
+uring(const struct lwan_request *request)
+{
+    return request->conn->thread->uring;
+}
+
+static ALWAYS_INLINE uint64_t
+uring_io_data(const struct lwan_request *request)
+{
+    return (uint64_t)(uintptr_t)request->conn | LWAN_URING_IO;
+}
+
+static ssize_t
+uring_wait(struct lwan_request *request, bool queued)
+{
+    int res;
+
+    if (UNLIKELY(!queued)) {
+        lwan_status_error("Could not queue I/O request for connection");
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    request->conn->flags |= CONN_IO_PENDING;
+    uring(request)->in_flight++;
+
+    res = coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+    if (UNLIKELY(res < 0)) {
+        errno = -res;
+        return -1;
+    }
+
+    return res;
+}
+#endif
+
+static ALWAYS_INLINE ssize_t
+do_sendmsg(struct lwan_request *request, const struct msghdr *msg, int flags)
+{
+#if defined(HAVE_IO_URING)
+    if (uring(request)) {
+        return uring_wait(request,
+            lwan_uring_prep_sendmsg(uring(request), request->fd, msg,
+                                    flags | MSG_DONTWAIT,
+                                    uring_io_data(request)));
+    }
+#endif
+
+    return sendmsg(request->fd, msg, flags);
+}
+
+static ALWAYS_INLINE ssize_t
+do_send(struct lwan_request *request, const void *buf, size_t count, int flags)
+{
+#if defined(HAVE_IO_URING)
+    if (uring(request)) {
+        return uring_wait(request,
+            lwan_uring_prep_send(uring(request), request->fd, buf, count,
+                                 flags | MSG_DONTWAIT, uring_io_data(request)));
+    }
+#endif
+
+    return send(request->fd, buf, count, flags);
+}
+
+static ssize_t
+writev_all(struct lwan_request *request, struct iovec *iov, int iov_count,
+    int flags)
 {
     ssize_t total_written = 0;
     int curr_iov = 0;
 
-    for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = writev(request->fd, iov + curr_iov, iov_count - curr_iov);
-        if (UNLIKELY(written < 0)) {
-            /* FIXME: Consider short writes as another try as well? */
-            tries--;
+    begin_write(request);
 
+    while (true) {
+        struct msghdr msg = {
+            .msg_iov = iov + curr_iov,
+            .msg_iovlen = (size_t)(iov_count - curr_iov),
+        };
+        ssize_t written = do_sendmsg(request, &msg, flags);
+        if (UNLIKELY(written < 0)) {
             switch (errno) {
             case EAGAIN:
+                wait_until_writable(request);
+                /* fallthrough */
             case EINTR:
-                goto try_again;
+                continue;
             default:
-                goto out;
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
             }
         }
 
+        wrote(request, (size_t)written);
         total_written += written;
 
         while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
@@ -63,48 +225,237 @@ lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
 
         iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
         iov[curr_iov].iov_len -= (size_t)written;
+    }
+}
 
-try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+static void
+batch_flush(struct lwan_request *request, struct lwan_response_batch *batch,
+    int flags)
+{
+    writev_all(request, batch->iov, batch->n_iov, flags);
+    batch->n_iov = 0;
+    batch->used = 0;
+}
+
+void
+lwan_response_batch_flush(struct lwan_request *request)
+{
+    struct lwan_response_batch *batch = request->batch;
+
+    if (batch && batch->n_iov)
+        batch_flush(request, batch, 0);
+}
+
+bool
+lwan_response_batch_add(struct lwan_request *request, const struct iovec *iov,
+    int iov_count)
+{
+    struct lwan_response_batch *batch = request->batch;
+    size_t len = 0;
+    char *p;
+
+    if (UNLIKELY(!batch))
+        return false;
+
+    for (int i = 0; i < iov_count; i++)
+        len += iov[i].iov_len;
+    if (len > DEFAULT_BUFFER_SIZE)
+        return false;
+
+    if (UNLIKELY(!batch->buffer)) {
+        batch->buffer = malloc(LWAN_RESPONSE_BATCH_SIZE);
+        if (UNLIKELY(!batch->buffer))
+            return false;
     }
 
-out:
-    coro_yield(request->conn->coro, CONN_CORO_ABORT);
-    __builtin_unreachable();
+    /* Full: what's being added is going to follow right away */
+    if (batch->used + len > LWAN_RESPONSE_BATCH_SIZE)
+        batch_flush(request, batch, MSG_MORE);
+
+    p = batch->buffer + batch->used;
+    batch->iov[batch->n_iov++] = (struct iovec) { .iov_base = p, .iov_len = len };
+    for (int i = 0; i < iov_count; i++)
+        p = mempcpy(p, iov[i].iov_base, iov[i].iov_len);
+    batch->used += len;
+
+    if (batch->n_iov == LWAN_RESPONSE_BATCH_IOV)
+        batch_flush(request, batch, 0);
+
+    return true;
+}
+
+#if defined(HAVE_MSG_ZEROCOPY)
+static ALWAYS_INLINE bool
+zerocopy_id_before(uint32_t id, uint32_t other)
+{
+    return (int32_t)(id - other) < 0;
+}
+
+static void
+zerocopy_release(struct lwan_response_batch *batch, bool all)
+{
+    struct lwan_zerocopy_ref *refs = batch->zerocopy.refs.base.base;
+    size_t n_refs = batch->zerocopy.refs.base.elements;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < n_refs; i++) {
+        if (all || zerocopy_id_before(refs[i].id, batch->zerocopy.completed_up_to))
+            refs[i].release(refs[i].data1, refs[i].data2);
+        else
+            refs[kept++] = refs[i];
+    }
+
+    if (kept)
+        batch->zerocopy.refs.base.elements = kept;
+    else
+        lwan_zerocopy_ref_array_reset(&batch->zerocopy.refs);
+}
+
+static void
+zerocopy_reap(struct lwan_response_batch *batch)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+
+    while (batch->zerocopy.refs.base.elements) {
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+
+        if (recvmsg(batch->zerocopy.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err *err;
+
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            err = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* Sends from ee_info to ee_data, inclusive, have completed.  These
+             * ranges are usually reported in order; if one isn't, references
+             * are kept until every send has completed.  */
+            batch->zerocopy.n_completed += err->ee_data - err->ee_info + 1;
+            if (err->ee_info == batch->zerocopy.completed_up_to)
+                batch->zerocopy.completed_up_to = err->ee_data + 1;
+        }
+
+        zerocopy_release(batch,
+            batch->zerocopy.n_completed == batch->zerocopy.next_id);
+    }
+}
+#endif
+
+void
+lwan_response_batch_free(struct lwan_response_batch *batch)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    if (batch->zerocopy.refs.base.elements) {
+        zerocopy_reap(batch);
+
+        if (batch->zerocopy.refs.base.elements) {
+            /* The connection is going away before the kernel is done with
+             * some buffers: reset it, so that nothing else is sent from them
+             * once they're released.  */
+            struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+            setsockopt(batch->zerocopy.fd, SOL_SOCKET, SO_LINGER, &linger,
+                sizeof(linger));
+            zerocopy_release(batch, true);
+        }
+    }
+#endif
+
+    free(batch->buffer);
+}
+
+ssize_t
+lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
+{
+    /* Responses still in the batch have to go out first */
+    lwan_response_batch_flush(request);
+
+    return writev_all(request, iov, iov_count, 0);
 }
 
 ssize_t
 lwan_send(struct lwan_request *request, const void *buf, size_t count, int flags)
 {
-    ssize_t total_sent = 0;
+    size_t total_sent = 0;
 
-    for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = send(request->fd, buf, count, flags);
-        if (UNLIKELY(written < 0)) {
-            tries--;
+    lwan_response_batch_flush(request);
 
+    begin_write(request);
+
+    while (true) {
+        ssize_t written = do_send(request, (const char *)buf + total_sent,
+            count - total_sent, flags);
+        if (UNLIKELY(written < 0)) {
             switch (errno) {
             case EAGAIN:
+                wait_until_writable(request);
+                /* fallthrough */
             case EINTR:
-                goto try_again;
+                continue;
             default:
-                goto out;
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
             }
         }
 
-        total_sent += written;
-        if ((size_t)total_sent == count)
-            return total_sent;
-        if ((size_t)total_sent < count)
-            buf = (char *)buf + written;
-
-try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wrote(request, (size_t)written);
+        total_sent += (size_t)written;
+        if (total_sent == count)
+            return (ssize_t)total_sent;
     }
+}
 
-out:
-    coro_yield(request->conn->coro, CONN_CORO_ABORT);
-    __builtin_unreachable();
+ssize_t
+lwan_recv(struct lwan_request *request, void *buf, size_t count, int flags)
+{
+    while (true) {
+        ssize_t n = recv(request->fd, buf, count, flags);
+
+        if (LIKELY(n >= 0))
+            return n;
+
+        switch (errno) {
+        case EAGAIN:
+            request->conn->flags &= ~CONN_READABLE;
+
+            /* Client might be waiting for these before sending more */
+            lwan_response_batch_flush(request);
+            request->conn->flags |= CONN_MUST_READ;
+
+#if defined(HAVE_IO_URING)
+            if (uring(request)) {
+                n = uring_wait(request,
+                    lwan_uring_prep_recv(uring(request), request->fd, buf,
+                                         count, flags, uring_io_data(request)));
+                if (n >= 0 || (errno != EAGAIN && errno != EINTR))
+                    return n;
+
+                /* Not retried by the kernel: wait until it's readable */
+            }
+#endif
+
+            coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+            /* fallthrough */
+        case EINTR:
+            continue;
+        default:
+            return -1;
+        }
+    }
 }
 
 #if defined(__linux__)
@@ -113,6 +464,75 @@ static inline size_t min_size(size_t a, size_t b)
     return (a > b) ? b : a;
 }
 
+#if defined(HAVE_IO_URING)
+static void
+close_pipe(void *data)
+{
+    int *pipefd = data;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+/* There's no sendfile() request: the file is spliced into a pipe, and from
+ * there into the socket.  */
+static void
+uring_sendfile(struct lwan_request *request, int in_fd, off_t offset,
+    size_t count)
+{
+    struct coro *coro = request->conn->coro;
+    size_t generation = coro_deferred_get_generation(coro);
+    int pipefd[2];
+
+    if (UNLIKELY(pipe2(pipefd, O_CLOEXEC) < 0)) {
+        coro_yield(coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+    coro_defer(coro, close_pipe, pipefd);
+
+    while (count > 0) {
+        ssize_t in = uring_wait(request,
+            lwan_uring_prep_splice(uring(request), in_fd, (int64_t)offset,
+                                   pipefd[1], -1, min_size(count, 1<<16), 0,
+                                   uring_io_data(request)));
+
+        /* Error, or file has been truncated while being sent */
+        if (UNLIKELY(in <= 0)) {
+            coro_yield(coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        offset += in;
+        count -= (size_t)in;
+
+        while (in > 0) {
+            ssize_t out = uring_wait(request,
+                lwan_uring_prep_splice(uring(request), pipefd[0], -1,
+                                       request->fd, -1, (size_t)in,
+                                       count ? SPLICE_F_MORE : 0,
+                                       uring_io_data(request)));
+
+            if (UNLIKELY(out <= 0)) {
+                /* Splicing isn't retried by the kernel once the socket
+                 * buffer is full: wait for it to drain */
+                if (out < 0 && errno == EAGAIN) {
+                    wait_until_writable(request);
+                    continue;
+                }
+
+                coro_yield(coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
+            }
+
+            wrote(request, (size_t)out);
+            in -= out;
+        }
+    }
+
+    coro_deferred_run(coro, generation);
+}
+#endif
+
 void
 lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t count,
     const char *header, size_t header_len)
@@ -122,13 +542,21 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
 
     lwan_send(request, header, header_len, MSG_MORE);
 
-    do {
+#if defined(HAVE_IO_URING)
+    if (uring(request)) {
+        uring_sendfile(request, in_fd, offset, count);
+        return;
+    }
+#endif
+
+    while (to_be_written > 0) {
         ssize_t written = sendfile(request->fd, in_fd, &offset, chunk_size);
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
+                wait_until_writable(request);
+                /* fallthrough */
             case EINTR:
-                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
                 continue;
 
             default:
@@ -137,11 +565,16 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
             }
         }
 
+        /* File has been truncated while being sent */
+        if (UNLIKELY(!written)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        wrote(request, (size_t)written);
         to_be_written -= (size_t)written;
         chunk_size = min_size(to_be_written, 1<<19);
-
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-    } while (to_be_written > 0);
+    }
 }
 #elif defined(__FreeBSD__) || defined(__APPLE__)
 void
@@ -160,6 +593,10 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
     size_t total_written = 0;
     off_t sbytes = (off_t)count;
 
+    lwan_response_batch_flush(request);
+
+    begin_write(request);
+
     do {
         int r;
 
@@ -172,10 +609,13 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         if (UNLIKELY(r < 0)) {
             switch (errno) {
             case EAGAIN:
+                wait_until_writable(request);
+                continue;
             case EBUSY:
-            case EINTR:
                 coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
                 continue;
+            case EINTR:
+                continue;
 
             default:
                 coro_yield(request->conn->coro, CONN_CORO_ABORT);
@@ -183,11 +623,166 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
             }
         }
 
+        wrote(request, (size_t)sbytes);
         total_written += (size_t)sbytes;
-
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
     } while (total_written < count);
 }
 #else
 #error No sendfile() implementation for this platform
 #endif
+
+bool
+lwan_can_send_zerocopy(const struct lwan_request *request, size_t count)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    const struct lwan_thread *t = request->conn->thread;
+    const size_t threshold = t->lwan->config.zerocopy_threshold;
+
+    if (!threshold || count < threshold)
+        return false;
+
+    /* Completions are signalled with POLLERR, which the io_uring backend
+     * takes as an error in the connection */
+    if (t->uring)
+        return false;
+
+    return request->batch &&
+        request->batch->zerocopy.state != ZEROCOPY_UNSUPPORTED;
+#else
+    (void)request;
+    (void)count;
+
+    return false;
+#endif
+}
+
+#if defined(HAVE_MSG_ZEROCOPY)
+static bool
+zerocopy_enable(struct lwan_request *request)
+{
+    struct lwan_response_batch *batch = request->batch;
+
+    if (batch->zerocopy.state == ZEROCOPY_UNKNOWN) {
+        int one = 1;
+
+        if (setsockopt(request->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            batch->zerocopy.state = ZEROCOPY_UNSUPPORTED;
+        } else {
+            batch->zerocopy.state = ZEROCOPY_ENABLED;
+            batch->zerocopy.fd = request->fd;
+        }
+    }
+
+    return batch->zerocopy.state == ZEROCOPY_ENABLED;
+}
+
+void
+lwan_send_zerocopy(struct lwan_request *request,
+                   const char *header, size_t header_len,
+                   const void *buf, size_t count,
+                   void (*release)(void *data1, void *data2),
+                   void *data1, void *data2)
+{
+    struct lwan_response_batch *batch = request->batch;
+    struct lwan_zerocopy_ref *ref;
+    int flags = MSG_ZEROCOPY;
+    size_t total_sent = 0;
+
+    /* The header is usually in the stack, so it's copied as usual */
+    lwan_send(request, header, header_len, MSG_MORE);
+
+    if (UNLIKELY(!zerocopy_enable(request)))
+        goto copy;
+
+    /* Taken before sending anything, so that the reference is dropped by
+     * lwan_response_batch_free() if the coroutine is aborted midway.  Until
+     * the first send, it's tied to the id of the previous one.  */
+    ref = lwan_zerocopy_ref_array_append(&batch->zerocopy.refs);
+    if (UNLIKELY(!ref))
+        goto copy;
+    *ref = (struct lwan_zerocopy_ref) {
+        .release = release,
+        .data1 = data1,
+        .data2 = data2,
+        .id = batch->zerocopy.next_id - 1,
+    };
+
+    while (total_sent < count) {
+        ssize_t written = send(request->fd, (const char *)buf + total_sent,
+            count - total_sent, flags);
+        if (UNLIKELY(written < 0)) {
+            switch (errno) {
+            case ENOBUFS:
+                /* Can't pin more pages for this socket: copy the rest */
+                if (flags) {
+                    flags = 0;
+                    continue;
+                }
+                break;
+            case EAGAIN:
+                wait_until_writable(request);
+                /* fallthrough */
+            case EINTR:
+                continue;
+            }
+
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        if (flags)
+            ref->id = batch->zerocopy.next_id++;
+
+        wrote(request, (size_t)written);
+        total_sent += (size_t)written;
+    }
+
+    zerocopy_reap(batch);
+    return;
+
+copy:
+    lwan_send(request, buf, count, 0);
+    release(data1, data2);
+}
+
+void
+lwan_zerocopy_wait(struct lwan_request *request)
+{
+    struct lwan_response_batch *batch = request->batch;
+
+    if (!batch || !batch->zerocopy.refs.base.elements)
+        return;
+
+    zerocopy_reap(batch);
+    if (!batch->zerocopy.refs.base.elements)
+        return;
+
+    /* Completions are signalled with EPOLLERR, which resumes the coroutine
+     * as if the socket were writable.  How long this takes is bound by the
+     * write timeout.  */
+    begin_write(request);
+    while (batch->zerocopy.refs.base.elements) {
+        request->conn->flags &= ~CONN_WRITABLE;
+        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+
+        zerocopy_reap(batch);
+    }
+}
+#else
+void
+lwan_send_zerocopy(struct lwan_request *request,
+                   const char *header, size_t header_len,
+                   const void *buf, size_t count,
+                   void (*release)(void *data1, void *data2),
+                   void *data1, void *data2)
+{
+    lwan_send(request, header, header_len, MSG_MORE);
+    lwan_send(request, buf, count, 0);
+    release(data1, data2);
+}
+
+void
+lwan_zerocopy_wait(struct lwan_request *request __attribute__((unused)))
+{
+}
+#endif
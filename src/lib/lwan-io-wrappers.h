@@ -28,6 +28,8 @@ ssize_t lwan_writev(struct lwan_request *request, struct iovec *iov,
                     int iovcnt);
 ssize_t lwan_send(struct lwan_request *request, const void *buf, size_t count,
                   int flags);
+ssize_t lwan_recv(struct lwan_request *request, void *buf, size_t count,
+                  int flags);
 void lwan_sendfile(struct lwan_request *request, int in_fd,
                     off_t offset, size_t count,
                     const char *header, size_t header_len);
@@ -27,7 +27,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 
-#include "lwan.h"
+#include "lwan-private.h"
 #include "lwan-status.h"
 #include "list.h"
 
@@ -136,6 +136,37 @@ void lwan_job_thread_shutdown(void)
     }
 }
 
+void lwan_job_thread_set_affinity(const char *cpu_list)
+{
+#if defined(HAS_PTHREAD_SETAFFINITY_NP)
+    unsigned int cpus[CPU_SETSIZE];
+    int n_cpus = parse_cpu_list(cpu_list, cpus, CPU_SETSIZE);
+    cpu_set_t set;
+    int r;
+
+    if (n_cpus <= 0) {
+        lwan_status_error("Invalid CPU list for job thread: %s", cpu_list);
+        return;
+    }
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < n_cpus; i++)
+        CPU_SET(cpus[i], &set);
+
+    r = pthread_setaffinity_np(self, sizeof(set), &set);
+    if (r) {
+        errno = r;
+        lwan_status_perror("pthread_setaffinity_np");
+        return;
+    }
+
+    lwan_status_debug("Job thread pinned to CPUs %s", cpu_list);
+#else
+    lwan_status_warning("Can't pin job thread to CPUs %s: not supported "
+                        "on this platform", cpu_list);
+#endif
+}
+
 void lwan_job_add(bool (*cb)(void *data), void *data)
 {
     assert(cb);
@@ -61,6 +61,15 @@ static int req_send_event_cb(lua_State *L)
     return 0;
 }
 
+static int req_flush_cb(lua_State *L)
+{
+    struct lwan_request *request = userdata_as_request(L, 1);
+
+    lwan_response_flush(request);
+
+    return 0;
+}
+
 static int req_set_response_cb(lua_State *L)
 {
     struct lwan_request *request = userdata_as_request(L, 1);
@@ -188,6 +197,7 @@ static const struct luaL_reg lwan_request_meta_regs[] = {
     { "set_response", req_set_response_cb },
     { "say", req_say_cb },
     { "send_event", req_send_event_cb },
+    { "flush", req_flush_cb },
     { "cookie", req_cookie_cb },
     { "set_headers", req_set_headers_cb },
     { NULL, NULL }
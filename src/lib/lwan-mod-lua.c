@@ -200,6 +200,8 @@ lua_handle_cb(struct lwan_request *request,
     while (true) {
         switch (lua_resume(L, n_arguments)) {
         case LUA_YIELD:
+            /* Whatever was said so far shouldn't wait for the next call */
+            lwan_response_flush(request);
             coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
             n_arguments = 0;
             break;
@@ -921,6 +921,12 @@ sendfile_serve(struct lwan_request *request, void *data)
     return return_status;
 }
 
+static void
+release_cache_entry(void *data1, void *data2)
+{
+    cache_entry_unref(data1, data2);
+}
+
 static enum lwan_http_status
 serve_contents_and_size(struct lwan_request *request, struct file_cache_entry *fce,
     const char *compression_type, const void *contents, size_t size)
@@ -940,6 +946,14 @@ serve_contents_and_size(struct lwan_request *request, struct file_cache_entry *f
 
     if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD || return_status == HTTP_NOT_MODIFIED) {
         lwan_send(request, headers, header_len, 0);
+    } else if (lwan_can_send_zerocopy(request, size) &&
+               cache_entry_try_ref(&fce->base)) {
+        struct serve_files_priv *priv = request->response.stream.priv;
+
+        /* Contents belong to the cache entry, which is kept alive until
+         * the kernel is done with them */
+        lwan_send_zerocopy(request, headers, header_len, contents, size,
+            release_cache_entry, priv->cache, fce);
     } else {
         struct iovec response_vec[] = {
             { .iov_base = headers, .iov_len = header_len },
@@ -0,0 +1,587 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-multipart.h"
+
+#define MULTIPART_WINDOW_SIZE (4 * DEFAULT_BUFFER_SIZE)
+#define MULTIPART_MAX_BOUNDARY 70
+#define MULTIPART_MAX_PARTS 256
+
+struct multipart_parser {
+    struct lwan_request *request;
+
+    /* Either the whole body, or a window over it if it's streamed */
+    char *buffer;
+    size_t start, end, size;
+    bool streamed;
+
+    /* "\r\n--" followed by the boundary */
+    char delimiter[MULTIPART_MAX_BOUNDARY + 4];
+    size_t delimiter_len;
+    uint8_t skip[256];
+
+    int pipefd[2];
+    size_t n_parts;
+
+    struct lwan_key_value_list *fields;
+    struct lwan_multipart_file *files;
+    size_t n_files, files_size;
+};
+
+static bool
+find_boundary(const char *content_type, const char **boundary, size_t *len)
+{
+    const char *p = strcasestr(content_type, "boundary=");
+
+    if (UNLIKELY(!p))
+        return false;
+    p += sizeof("boundary=") - 1;
+
+    if (*p == '"') {
+        const char *end = strchr(++p, '"');
+
+        if (UNLIKELY(!end))
+            return false;
+        *len = (size_t)(end - p);
+    } else {
+        *len = strcspn(p, "; \t");
+    }
+
+    *boundary = p;
+    return *len > 0 && *len <= MULTIPART_MAX_BOUNDARY;
+}
+
+static void
+prepare_delimiter(struct multipart_parser *parser, const char *boundary,
+    size_t len)
+{
+    const size_t last = len + 4 - 1;
+
+    memcpy(parser->delimiter, "\r\n--", 4);
+    memcpy(parser->delimiter + 4, boundary, len);
+    parser->delimiter_len = len + 4;
+
+    /* Bad character table for Boyer-Moore-Horspool */
+    memset(parser->skip, (int)parser->delimiter_len, sizeof(parser->skip));
+    for (size_t i = 0; i < last; i++)
+        parser->skip[(unsigned char)parser->delimiter[i]] = (uint8_t)(last - i);
+}
+
+static char *
+find_delimiter(const struct multipart_parser *parser, char *haystack, size_t len)
+{
+    const size_t last = parser->delimiter_len - 1;
+    const char *end = haystack + len;
+    char *p = haystack;
+
+    while ((size_t)(end - p) > last) {
+        const unsigned char c = (unsigned char)p[last];
+
+        if (c == (unsigned char)parser->delimiter[last] &&
+                !memcmp(p, parser->delimiter, last))
+            return p;
+
+        p += parser->skip[c];
+    }
+
+    return NULL;
+}
+
+/* Reads more of a streamed body into the window, making room for it
+ * first; fails if the window is full, or if the body ended.  */
+static bool
+fill(struct multipart_parser *parser)
+{
+    ssize_t n;
+
+    if (!parser->streamed)
+        return false;
+
+    if (parser->start) {
+        memmove(parser->buffer, parser->buffer + parser->start,
+            parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+    if (UNLIKELY(parser->end == parser->size))
+        return false;
+
+    n = lwan_request_read_body(parser->request, parser->buffer + parser->end,
+        parser->size - parser->end);
+    if (UNLIKELY(n <= 0))
+        return false;
+
+    parser->end += (size_t)n;
+    return true;
+}
+
+static bool
+ensure(struct multipart_parser *parser, size_t len)
+{
+    while (parser->end - parser->start < len) {
+        if (!fill(parser))
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+skip_preamble(struct multipart_parser *parser)
+{
+    /* The first delimiter usually starts the body, so there's no CRLF
+     * before it */
+    const size_t len = parser->delimiter_len - 2;
+
+    if (!ensure(parser, len))
+        return false;
+    if (LIKELY(!memcmp(parser->buffer + parser->start, parser->delimiter + 2, len))) {
+        parser->start += len;
+        return true;
+    }
+
+    while (true) {
+        char *found = find_delimiter(parser, parser->buffer + parser->start,
+            parser->end - parser->start);
+
+        if (found) {
+            parser->start = (size_t)(found - parser->buffer) + parser->delimiter_len;
+            return true;
+        }
+
+        if (parser->end - parser->start >= parser->delimiter_len)
+            parser->start = parser->end - (parser->delimiter_len - 1);
+        if (!fill(parser))
+            return false;
+    }
+}
+
+/* Parses parameters such as `form-data; name="field"; filename="f.txt"` */
+static void
+parse_disposition(char *p, char **name, char **filename)
+{
+    size_t name_len = 0, filename_len = 0;
+
+    p += strcspn(p, ";");
+
+    while (*p == ';') {
+        char *key, *value;
+        size_t key_len, value_len;
+
+        p++;
+        p += strspn(p, " \t");
+        key = p;
+        key_len = strcspn(p, "=; \t");
+        p += key_len;
+        p += strspn(p, " \t");
+        if (*p != '=') {
+            p += strcspn(p, ";");
+            continue;
+        }
+        p++;
+        p += strspn(p, " \t");
+
+        if (*p == '"') {
+            char *quote;
+
+            value = p + 1;
+            quote = strchr(value, '"');
+            if (UNLIKELY(!quote))
+                break;
+
+            value_len = (size_t)(quote - value);
+            p = quote + 1;
+            p += strcspn(p, ";");
+        } else {
+            value = p;
+            value_len = strcspn(p, "; \t");
+            p += value_len;
+            p += strcspn(p, ";");
+        }
+
+        if (key_len == sizeof("name") - 1 && !strncasecmp(key, "name", key_len)) {
+            *name = value;
+            name_len = value_len;
+        } else if (key_len == sizeof("filename") - 1 &&
+                   !strncasecmp(key, "filename", key_len)) {
+            *filename = value;
+            filename_len = value_len;
+        }
+    }
+
+    /* Values end in a quote or a separator that's not needed anymore */
+    if (*name)
+        (*name)[name_len] = '\0';
+    if (*filename)
+        (*filename)[filename_len] = '\0';
+}
+
+static bool
+write_all(int fd, const char *buffer, size_t len)
+{
+    while (len) {
+        ssize_t written = write(fd, buffer, len);
+
+        if (UNLIKELY(written < 0)) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        buffer += written;
+        len -= (size_t)written;
+    }
+
+    return true;
+}
+
+/* Moves whatever comes before the delimiter straight from the socket to
+ * the file.  Returns false if nothing could be done this way.  */
+static bool
+splice_part(struct multipart_parser *parser, int fd, off_t *size)
+{
+    struct lwan_request *request = parser->request;
+    const size_t kept = parser->end - parser->start;
+    size_t total, safe;
+    ssize_t peeked;
+    char *found;
+
+    if (parser->pipefd[0] < 0)
+        return false;
+
+    peeked = lwan_request_peek_body(request, parser->buffer + parser->end,
+        parser->size - parser->end);
+    if (peeked <= 0)
+        return false;
+
+    total = kept + (size_t)peeked;
+    found = find_delimiter(parser, parser->buffer + parser->start, total);
+    if (found)
+        safe = (size_t)(found - (parser->buffer + parser->start));
+    else if (total >= parser->delimiter_len)
+        safe = total - (parser->delimiter_len - 1);
+    else
+        return false;
+
+    if (safe <= kept) {
+        if (!safe)
+            return false;
+
+        if (UNLIKELY(!write_all(fd, parser->buffer + parser->start, safe)))
+            return false;
+        parser->start += safe;
+        *size += (off_t)safe;
+        return true;
+    }
+
+    if (UNLIKELY(!write_all(fd, parser->buffer + parser->start, kept)))
+        return false;
+    parser->start = parser->end = 0;
+
+    if (UNLIKELY(lwan_request_splice_body(request, parser->pipefd, fd,
+            safe - kept) < 0))
+        return false;
+
+    *size += (off_t)safe;
+    return true;
+}
+
+static bool
+read_file_part(struct multipart_parser *parser, int fd, off_t *size)
+{
+    *size = 0;
+
+    while (true) {
+        char *data = parser->buffer + parser->start;
+        size_t len = parser->end - parser->start;
+        char *found = find_delimiter(parser, data, len);
+        size_t keep;
+
+        if (found) {
+            if (UNLIKELY(!write_all(fd, data, (size_t)(found - data))))
+                return false;
+
+            *size += found - data;
+            parser->start = (size_t)(found - parser->buffer);
+            return true;
+        }
+
+        /* The end might be the beginning of a delimiter */
+        keep = len < parser->delimiter_len - 1 ? len : parser->delimiter_len - 1;
+        if (UNLIKELY(!write_all(fd, data, len - keep)))
+            return false;
+        *size += (off_t)(len - keep);
+        parser->start += len - keep;
+
+        memmove(parser->buffer, parser->buffer + parser->start, keep);
+        parser->start = 0;
+        parser->end = keep;
+
+        if (splice_part(parser, fd, size))
+            continue;
+        if (!fill(parser))
+            return false;
+    }
+}
+
+static struct lwan_multipart_file *
+append_file(struct multipart_parser *parser)
+{
+    if (parser->n_files == parser->files_size) {
+        size_t new_size = parser->files_size ? parser->files_size * 2 : 4;
+        struct lwan_multipart_file *files;
+
+        files = coro_malloc(parser->request->conn->coro,
+            new_size * sizeof(*files));
+        if (UNLIKELY(!files))
+            return NULL;
+
+        if (parser->n_files)
+            memcpy(files, parser->files, parser->n_files * sizeof(*files));
+        parser->files = files;
+        parser->files_size = new_size;
+    }
+
+    return &parser->files[parser->n_files++];
+}
+
+static void
+close_file(void *data)
+{
+    close((int)(intptr_t)data);
+}
+
+static bool
+parse_part(struct multipart_parser *parser)
+{
+    struct coro *coro = parser->request->conn->coro;
+    char *name = NULL, *filename = NULL, *content_type = NULL;
+    char *headers, *headers_end;
+    char *found;
+
+    if (UNLIKELY(++parser->n_parts > MULTIPART_MAX_PARTS))
+        return false;
+
+    /* Part headers have to fit in the window */
+    if (!ensure(parser, 2))
+        return false;
+    headers = parser->buffer + parser->start;
+    if (headers[0] == '\r' && headers[1] == '\n') {
+        headers_end = headers;
+    } else {
+        while (!(headers_end = memmem(parser->buffer + parser->start,
+                                      parser->end - parser->start,
+                                      "\r\n\r\n", 4))) {
+            if (!fill(parser))
+                return false;
+        }
+        headers = parser->buffer + parser->start;
+        headers_end += 2;
+    }
+    parser->start = (size_t)(headers_end - parser->buffer) + 2;
+
+    for (char *line = headers; line < headers_end; ) {
+        char *eol = memchr(line, '\r', (size_t)(headers_end - line));
+
+        /* Lines have to end with CRLF; headers_end is always followed
+         * by one, so eol[1] can be read.  */
+        if (UNLIKELY(!eol || eol[1] != '\n'))
+            return false;
+
+        *eol = '\0';
+        if (!strncasecmp(line, "Content-Disposition:", sizeof("Content-Disposition:") - 1)) {
+            parse_disposition(line + sizeof("Content-Disposition:") - 1,
+                &name, &filename);
+        } else if (!strncasecmp(line, "Content-Type:", sizeof("Content-Type:") - 1)) {
+            content_type = line + sizeof("Content-Type:") - 1;
+            content_type += strspn(content_type, " \t");
+        }
+
+        line = eol + 2;
+    }
+
+    if (parser->streamed) {
+        /* Window is going to be reused */
+        if (name && UNLIKELY(!(name = coro_strdup(coro, name))))
+            return false;
+        if (filename && UNLIKELY(!(filename = coro_strdup(coro, filename))))
+            return false;
+        if (content_type && UNLIKELY(!(content_type = coro_strdup(coro, content_type))))
+            return false;
+    }
+
+    if (filename && name) {
+        struct lwan_multipart_file *file = append_file(parser);
+
+        if (UNLIKELY(!file))
+            return false;
+
+        *file = (struct lwan_multipart_file) {
+            .name = name,
+            .filename = filename,
+            .content_type = content_type ? content_type : "application/octet-stream",
+            .fd = -1,
+        };
+
+        if (parser->streamed) {
+            int fd = lwan_create_temp_file();
+
+            if (UNLIKELY(fd < 0))
+                return false;
+            coro_defer(coro, close_file, (void *)(intptr_t)fd);
+
+            file->fd = fd;
+            if (!read_file_part(parser, fd, &file->size))
+                return false;
+        } else {
+            found = find_delimiter(parser, parser->buffer + parser->start,
+                parser->end - parser->start);
+            if (UNLIKELY(!found))
+                return false;
+
+            file->contents.value = parser->buffer + parser->start;
+            file->contents.len = (size_t)(found - file->contents.value);
+            file->size = (off_t)file->contents.len;
+            parser->start = (size_t)(found - parser->buffer);
+        }
+    } else {
+        /* Fields have to fit in the window if the body is streamed */
+        while (!(found = find_delimiter(parser, parser->buffer + parser->start,
+                                        parser->end - parser->start))) {
+            if (!fill(parser))
+                return false;
+        }
+
+        if (name) {
+            struct lwan_key_value *kv;
+            char *value = parser->buffer + parser->start;
+            size_t len = (size_t)(found - value);
+
+            if (parser->streamed) {
+                value = coro_strndup(coro, value, len);
+                if (UNLIKELY(!value))
+                    return false;
+            } else {
+                value[len] = '\0';
+            }
+
+            kv = lwan_key_value_list_append(parser->request, parser->fields);
+            if (UNLIKELY(!kv))
+                return false;
+            kv->key = name;
+            kv->value = value;
+        }
+
+        parser->start = (size_t)(found - parser->buffer);
+    }
+
+    parser->start += parser->delimiter_len;
+    return true;
+}
+
+#if defined(HAS_SPLICE)
+static void
+close_pipe(void *data)
+{
+    int *pipefd = data;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+#endif
+
+bool
+lwan_multipart_parse(struct lwan_request *request,
+                     const char *content_type,
+                     struct lwan_value *body,
+                     struct lwan_key_value_list *fields,
+                     struct lwan_multipart_file **files,
+                     size_t *n_files)
+{
+    struct coro *coro = request->conn->coro;
+    struct multipart_parser *parser;
+    const char *boundary;
+    size_t boundary_len;
+
+    if (UNLIKELY(!find_boundary(content_type, &boundary, &boundary_len)))
+        return false;
+
+    parser = coro_malloc(coro, sizeof(*parser));
+    if (UNLIKELY(!parser))
+        return false;
+
+    *parser = (struct multipart_parser) {
+        .request = request,
+        .fields = fields,
+        .pipefd = { -1, -1 },
+    };
+    prepare_delimiter(parser, boundary, boundary_len);
+
+    if (body) {
+        parser->buffer = body->value;
+        parser->end = parser->size = body->len;
+    } else {
+        parser->buffer = coro_malloc(coro, MULTIPART_WINDOW_SIZE);
+        if (UNLIKELY(!parser->buffer))
+            return false;
+        parser->size = MULTIPART_WINDOW_SIZE;
+        parser->streamed = true;
+
+#if defined(HAS_SPLICE)
+        if (LIKELY(!pipe2(parser->pipefd, O_CLOEXEC)))
+            coro_defer(coro, close_pipe, parser->pipefd);
+        else
+            parser->pipefd[0] = parser->pipefd[1] = -1;
+#endif
+    }
+
+    if (!skip_preamble(parser))
+        return false;
+
+    while (true) {
+        /* A delimiter followed by "--" ends the body; the epilogue, if
+         * any, is discarded with what's left of the body. */
+        if (!ensure(parser, 2))
+            return false;
+        if (parser->buffer[parser->start] == '-' &&
+                parser->buffer[parser->start + 1] == '-')
+            break;
+
+        if (UNLIKELY(parser->buffer[parser->start] != '\r' ||
+                     parser->buffer[parser->start + 1] != '\n'))
+            return false;
+        parser->start += 2;
+
+        if (!parse_part(parser))
+            return false;
+    }
+
+    *files = parser->files;
+    *n_files = parser->n_files;
+    return true;
+}
@@ -0,0 +1,34 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* Parses a multipart/form-data body.  If body is NULL, it's read from the
+ * request as it arrives, and file parts are moved to temporary files;
+ * otherwise, it's parsed in place.  Fields are appended to fields, and
+ * file parts are returned in an array allocated in the coroutine.  */
+bool
+lwan_multipart_parse(struct lwan_request *request,
+                     const char *content_type,
+                     struct lwan_value *body,
+                     struct lwan_key_value_list *fields,
+                     struct lwan_multipart_file **files,
+                     size_t *n_files);
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
 #include "lwan.h"
 
 void lwan_response_init(struct lwan *l);
@@ -30,6 +32,7 @@ void lwan_socket_shutdown(struct lwan *l);
 void lwan_thread_init(struct lwan *l);
 void lwan_thread_shutdown(struct lwan *l);
 void lwan_thread_add_client(struct lwan_thread *t, int fd);
+void lwan_thread_add_listener(struct lwan_thread *t, int fd);
 
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
@@ -38,15 +41,120 @@ void lwan_job_thread_init(void);
 void lwan_job_thread_shutdown(void);
 void lwan_job_add(bool (*cb)(void *data), void *data);
 void lwan_job_del(bool (*cb)(void *data), void *data);
+void lwan_job_thread_set_affinity(const char *cpu_list);
 
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
+/* Buffer requests are read into.  It starts as DEFAULT_BUFFER_SIZE bytes in
+ * the coroutine stack, and is replaced by larger buffers, taken from a
+ * per-thread pool, if a request header doesn't fit.  */
+struct lwan_request_buffer {
+    char *value;
+    size_t len;
+    size_t size;
+    char *initial;
+};
+
+void lwan_request_buffer_init(struct lwan_request_buffer *buffer,
+                              char *initial);
+void lwan_request_buffer_release(struct lwan_request_buffer *buffer);
+void lwan_request_buffer_pool_drain(void);
+
 char *lwan_process_request(struct lwan *l, struct lwan_request *request,
-                           struct lwan_value *buffer, char *next_request);
+                           struct lwan_request_buffer *buffer, char *next_request);
+bool lwan_request_is_pipelined(const struct lwan_request *request);
+
+/* Responses to pipelined requests, and chunks or events of streamed
+ * responses, are copied here, one iovec each, and sent together once no
+ * more requests are buffered, once the response ends, or once it's full.
+ * The storage is only allocated the first time it's needed.  */
+#define LWAN_RESPONSE_BATCH_SIZE (4 * DEFAULT_BUFFER_SIZE)
+#define LWAN_RESPONSE_BATCH_IOV 16
+
+/* Something sent with MSG_ZEROCOPY is kept alive, by holding a reference
+ * to it, until the kernel says (through the socket error queue) that the
+ * send with the given id, and every one before it, has completed.  */
+struct lwan_zerocopy_ref {
+    void (*release)(void *data1, void *data2);
+    void *data1, *data2;
+    uint32_t id;
+};
+
+DEFINE_ARRAY_TYPE(lwan_zerocopy_ref_array, struct lwan_zerocopy_ref)
+
+struct lwan_response_batch {
+    struct iovec iov[LWAN_RESPONSE_BATCH_IOV];
+    int n_iov;
+    size_t used;
+    char *buffer;
+
+    /* How fast the client makes room in the socket buffer for the response
+     * being written: time spent waiting for it to be writable, and bytes
+     * written since the first time it had to wait */
+    uint64_t blocked_ms;
+    size_t drained;
+    bool has_blocked;
+
+    struct {
+        struct lwan_zerocopy_ref_array refs;
+        int fd;
+        uint32_t next_id;           /* Id the kernel gives the next send */
+        uint32_t completed_up_to;   /* Sends before this one completed */
+        uint32_t n_completed;
+        enum {
+            ZEROCOPY_UNKNOWN,
+            ZEROCOPY_ENABLED,
+            ZEROCOPY_UNSUPPORTED,
+        } state;
+    } zerocopy;
+};
+
+bool lwan_response_batch_add(struct lwan_request *request,
+                           const struct iovec *iov, int iov_count);
+void lwan_response_batch_flush(struct lwan_request *request);
+void lwan_response_batch_free(struct lwan_response_batch *batch);
+
+/* Bodies at least zerocopy_threshold bytes long can be sent without being
+ * copied to the socket buffers.  The caller takes a reference to buf, and
+ * lwan_send_zerocopy() drops it with release() once the kernel no longer
+ * needs it.  Before a coroutine is done with a connection, it waits for
+ * these sends to complete with lwan_zerocopy_wait().  */
+bool lwan_can_send_zerocopy(const struct lwan_request *request, size_t count);
+void lwan_send_zerocopy(struct lwan_request *request,
+                        const char *header, size_t header_len,
+                        const void *buf, size_t count,
+                        void (*release)(void *data1, void *data2),
+                        void *data1, void *data2);
+void lwan_zerocopy_wait(struct lwan_request *request);
+
+int lwan_create_temp_file(void);
+struct lwan_key_value *lwan_key_value_list_append(struct lwan_request *request,
+                           struct lwan_key_value_list *list);
+
+/* Streamed bodies can be looked at without being consumed, and then moved
+ * to a file descriptor without going through userspace.  Peeking returns 0
+ * if that isn't possible (e.g. chunked bodies, or bytes that were read
+ * together with the header), and only what has been peeked can be spliced. */
+ssize_t lwan_request_peek_body(struct lwan_request *request, char *buffer,
+                           size_t len);
+ssize_t lwan_request_splice_body(struct lwan_request *request, int pipefd[2],
+                           int fd, size_t len);
 size_t lwan_prepare_response_header_full(struct lwan_request *request,
      enum lwan_http_status status, char headers[],
      size_t headers_buf_size, const struct lwan_key_value *additional_headers);
+/* Headers that don't fit in *headers are moved to a larger buffer,
+ * allocated in the coroutine, which is then returned through it.  */
+size_t lwan_prepare_response_header_growable(struct lwan_request *request,
+     enum lwan_http_status status, char **headers, size_t headers_buf_size);
+
+static inline void
+lwan_connection_set_phase(struct lwan_connection *conn,
+    enum lwan_connection_flags phase)
+{
+    if ((conn->flags & CONN_PHASE_MASK) != phase)
+        conn->flags = (conn->flags & ~CONN_PHASE_MASK) | phase | CONN_PHASE_CHANGED;
+}
 
 void lwan_straitjacket_enforce_from_config(struct config *c);
 
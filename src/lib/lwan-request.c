@@ -37,7 +37,12 @@
 #include "lwan-private.h"
 
 #include "lwan-config.h"
+#include "lwan-header-hash.h"
 #include "lwan-http-authorize.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-multipart.h"
+#include "lwan-scan.h"
+#include "known-headers.h"
 
 enum lwan_read_finalizer {
     FINALIZER_DONE,
@@ -47,6 +52,42 @@ enum lwan_read_finalizer {
     FINALIZER_ERROR_TIMEOUT
 };
 
+/* Name and value of every request header, as offsets from the start of
+ * the request.  Lookups by well-known names are indexed lazily, so that
+ * requests whose handlers never look at headers don't pay for it.  */
+struct lwan_header_index {
+    char *base;
+    uint8_t n_headers;
+    bool well_known_indexed;
+    uint8_t well_known[HEADER_TABLE_SIZE];   /* Position in headers[] + 1 */
+    struct {
+        uint16_t name, name_len;
+        uint16_t value;
+    } headers[LWAN_SCAN_MAX_LINES];
+};
+
+enum chunked_state {
+    CHUNKED_NONE,			/* Body isn't chunked */
+    CHUNKED_SIZE_START,
+    CHUNKED_SIZE,
+    CHUNKED_EXTENSION,
+    CHUNKED_SIZE_LF,
+    CHUNKED_DATA,
+    CHUNKED_DATA_CR,
+    CHUNKED_DATA_LF,
+    CHUNKED_TRAILER_START,
+    CHUNKED_TRAILER,
+    CHUNKED_TRAILER_LF,
+    CHUNKED_END_LF,
+    CHUNKED_DONE,
+    CHUNKED_ERROR,			/* Where the body ends isn't known */
+};
+
+struct chunked_decoder {
+    enum chunked_state state;
+    size_t size;			/* Being parsed, or left in this chunk */
+};
+
 struct request_parser_helper {
     struct lwan_value *buffer;
     char *next_request;			/* For pipelined requests */
@@ -58,10 +99,22 @@ struct request_parser_helper {
     struct lwan_value query_string;
     struct lwan_value fragment;
     struct lwan_value content_length;
+    struct lwan_value transfer_encoding;
     struct lwan_value authorization;
+    struct lwan_value expect;
 
     struct lwan_value post_data;
     struct lwan_value content_type;
+    size_t body_remaining;		/* Body bytes not read by anyone yet */
+    struct chunked_decoder chunked;
+    bool expect_continue;		/* Client waits for "100 Continue" */
+
+    bool multipart_pending;		/* Parsed on first lookup */
+    struct lwan_multipart_file *files;
+    size_t n_files;
+
+    struct lwan_line_scan scan;		/* Line ends found while reading */
+    struct lwan_header_index header_index;
 
     time_t error_when_time;
     int error_when_n_packets;
@@ -305,8 +358,14 @@ url_decode(char *str)
     if (UNLIKELY(!str))
         return -EINVAL;
 
-    char *ch, *decoded;
-    for (decoded = ch = str; *ch; ch++) {
+    /* Most URLs have nothing to decode: skip straight to the first
+     * character that needs it */
+    char *ch = lwan_scan_url_special(str);
+    if (LIKELY(!*ch))
+        return (ssize_t)(ch - str);
+
+    char *decoded;
+    for (decoded = ch; *ch; ch++) {
         if (*ch == '%' && LIKELY(lwan_char_isxdigit(ch[1]) && lwan_char_isxdigit(ch[2]))) {
             char tmp;
 
@@ -334,21 +393,39 @@ key_value_compare(const void *a, const void *b)
     return strcmp(((struct lwan_key_value *)a)->key, ((struct lwan_key_value *)b)->key);
 }
 
+struct lwan_key_value *
+lwan_key_value_list_append(struct lwan_request *request,
+    struct lwan_key_value_list *list)
+{
+    if (UNLIKELY(list->len == list->size)) {
+        struct lwan_key_value *spill;
+        unsigned int new_size = list->size * 2;
+
+        spill = coro_malloc(request->conn->coro, new_size * sizeof(*spill));
+        if (UNLIKELY(!spill))
+            return NULL;
+
+        list->base = memcpy(spill, list->base, list->len * sizeof(*spill));
+        list->size = new_size;
+    }
+
+    return &list->base[list->len++];
+}
+
 static void
 parse_key_values(struct lwan_request *request,
-    struct lwan_value *helper_value, struct lwan_key_value_array *array,
+    struct lwan_key_value_list *list,
     ssize_t (*decode_value)(char *value), const char separator)
 {
     struct lwan_key_value *kv;
-    char *ptr = helper_value->value;
+    char *ptr = list->unparsed.value;
 
-    if (!helper_value->len)
-        return;
+    list->base = list->inline_kv;
+    list->size = LWAN_KEY_VALUE_LIST_INLINE;
+    list->len = 0;
 
-    lwan_key_value_array_init(array);
-    /* Calling lwan_key_value_array_reset() twice is fine, so even if 'goto
-     * error' is executed in this function, nothing bad should happen.  */
-    coro_defer(request->conn->coro, CORO_DEFER(lwan_key_value_array_reset), array);
+    if (!list->unparsed.len)
+        return;
 
     do {
         char *key, *value;
@@ -374,7 +451,7 @@ parse_key_values(struct lwan_request *request,
             goto error;
         }
 
-        kv = lwan_key_value_array_append(array);
+        kv = lwan_key_value_list_append(request, list);
         if (UNLIKELY(!kv))
             goto error;
 
@@ -382,17 +459,23 @@ parse_key_values(struct lwan_request *request,
         kv->value = value;
     } while (ptr);
 
-    kv = lwan_key_value_array_append(array);
-    if (UNLIKELY(!kv))
-        goto error;
-    kv->key = kv->value = NULL;
-
-    lwan_key_value_array_sort(array, key_value_compare);
+    /* Only lists that didn't fit inline are searched with bsearch() */
+    if (list->len > LWAN_KEY_VALUE_LIST_INLINE)
+        qsort(list->base, list->len, sizeof(*kv), key_value_compare);
 
     return;
 
 error:
-    lwan_key_value_array_reset(array);
+    list->base = list->inline_kv;
+    list->len = 0;
+}
+
+static ALWAYS_INLINE void
+key_value_list_init(struct lwan_key_value_list *list, struct lwan_value value)
+{
+    list->unparsed = value;
+    list->base = NULL;
+    list->len = 0;
 }
 
 static ssize_t
@@ -401,35 +484,28 @@ identity_decode(char *input __attribute__((unused)))
     return 1;
 }
 
-static void
-parse_cookies(struct lwan_request *request, struct request_parser_helper *helper)
+static bool
+content_type_is(const struct request_parser_helper *helper,
+    const char *content_type, size_t len)
 {
-    parse_key_values(request, &helper->cookie, &request->cookies,
-        identity_decode, ';');
+    if (helper->content_type.len < len)
+        return false;
+    return !strncasecmp(helper->content_type.value, content_type, len);
 }
 
-static void
-parse_query_string(struct lwan_request *request, struct request_parser_helper *helper)
-{
-    parse_key_values(request, &helper->query_string, &request->query_params,
-        url_decode, '&');
-}
+#define CONTENT_TYPE_IS(helper, type) \
+    content_type_is((helper), (type), sizeof(type) - 1)
 
 static void
-parse_post_data(struct lwan_request *request, struct request_parser_helper *helper)
+prepare_post_data(struct lwan_request *request, struct request_parser_helper *helper)
 {
-    static const char content_type[] = "application/x-www-form-urlencoded";
-
     request->header.body = &helper->post_data;
     request->header.content_type = &helper->content_type;
 
-    if (helper->content_type.len < sizeof(content_type) - 1)
-        return;
-    if (UNLIKELY(strncmp(helper->content_type.value, content_type, sizeof(content_type) - 1)))
-        return;
-
-    parse_key_values(request, &helper->post_data, &request->post_data,
-        url_decode, '&');
+    if (CONTENT_TYPE_IS(helper, "application/x-www-form-urlencoded"))
+        key_value_list_init(&request->post_data, helper->post_data);
+    else if (CONTENT_TYPE_IS(helper, "multipart/form-data"))
+        helper->multipart_pending = true;
 }
 
 static void
@@ -503,24 +579,15 @@ identify_http_path(struct lwan_request *request, char *buffer,
 #define MATCH_HEADER(hdr) \
   do { \
         p += sizeof(hdr) - 1; \
-        if (UNLIKELY(p >= buffer_end)) /* reached the end of header blocks */ \
-            return NULL; \
+        if (UNLIKELY(p + 2 > value_end)) \
+            goto next_line; \
         \
         if (UNLIKELY(string_as_int16(p) != HTTP_HDR_COLON_SPACE)) \
-            goto did_not_match; \
-        p += 2; \
-        \
-        char *end = strchr(p, '\r'); \
-        if (UNLIKELY(!end)) \
-            goto did_not_match; \
-        \
-        *end = '\0'; \
-        value = p; \
-        length = (size_t)(end - value); \
+            goto next_line; \
         \
-        p = end + 1; \
-        if (UNLIKELY(*p != '\n')) \
-            goto did_not_match; \
+        *value_end = '\0'; \
+        value = p + 2; \
+        length = (size_t)(value_end - value); \
   } while (0)
 
 #define CASE_HEADER(hdr_const,hdr_name) \
@@ -531,7 +598,6 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
 {
     enum {
         HTTP_HDR_COLON_SPACE       = MULTICHAR_CONSTANT_SMALL(':', ' '),
-        HTTP_HDR_REQUEST_END       = MULTICHAR_CONSTANT_SMALL('\r','\n'),
         HTTP_HDR_ENCODING          = MULTICHAR_CONSTANT_L('-','E','n','c'),
         HTTP_HDR_LENGTH            = MULTICHAR_CONSTANT_L('-','L','e','n'),
         HTTP_HDR_TYPE              = MULTICHAR_CONSTANT_L('-','T','y','p'),
@@ -540,16 +606,67 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
         HTTP_HDR_CONNECTION        = MULTICHAR_CONSTANT_L('C','o','n','n'),
         HTTP_HDR_CONTENT           = MULTICHAR_CONSTANT_L('C','o','n','t'),
         HTTP_HDR_COOKIE            = MULTICHAR_CONSTANT_L('C','o','o','k'),
+        HTTP_HDR_EXPECT            = MULTICHAR_CONSTANT_L('E','x','p','e'),
         HTTP_HDR_IF_MODIFIED_SINCE = MULTICHAR_CONSTANT_L('I','f','-','M'),
-        HTTP_HDR_RANGE             = MULTICHAR_CONSTANT_L('R','a','n','g')
+        HTTP_HDR_RANGE             = MULTICHAR_CONSTANT_L('R','a','n','g'),
+        HTTP_HDR_TRANSFER_ENCODING = MULTICHAR_CONSTANT_L('T','r','a','n')
     };
+    const struct lwan_line_scan *scan = &helper->scan;
+    struct lwan_header_index *index = &helper->header_index;
+    char *base = helper->buffer->value;
+    uint32_t line = 0;
 
-    for (char *p = buffer; *p; buffer = ++p) {
-        char *value;
+    index->base = base;
+
+    /* Line ends were found while reading the request; skip the ones
+     * belonging to the request line (and the PROXY header, if any) */
+    while (line < scan->n_lines && base + scan->lines[line] < buffer)
+        line++;
+
+    while (buffer < buffer_end) {
+        char *p = buffer;
+        char *line_end, *value_end, *value;
         size_t length;
 
-        if ((p + sizeof(int32_t)) >= buffer_end)
-            break;
+        if (LIKELY(line < scan->n_lines)) {
+            line_end = base + scan->lines[line++];
+        } else {
+            /* Header has more lines than the scanner keeps track of */
+            line_end = memchr(p, '\n', (size_t)(buffer_end - p));
+            if (UNLIKELY(!line_end))
+                break;
+        }
+        buffer = line_end + 1;
+
+        if (UNLIKELY(line_end == p || line_end[-1] != '\r'))
+            continue;
+        value_end = line_end - 1;
+
+        if (value_end == p) {
+            *p = '\0';
+            helper->next_request = buffer;
+            return p;
+        }
+
+        if (LIKELY(index->n_headers < N_ELEMENTS(index->headers))) {
+            char *colon = memchr(p, ':', (size_t)(value_end - p));
+
+            if (LIKELY(colon)) {
+                char *header_value = colon + 1;
+
+                while (header_value < value_end && lwan_char_isspace(*header_value))
+                    header_value++;
+                *value_end = '\0';
+
+                index->headers[index->n_headers].name = (uint16_t)(p - base);
+                index->headers[index->n_headers].name_len = (uint16_t)(colon - p);
+                index->headers[index->n_headers].value = (uint16_t)(header_value - base);
+                index->n_headers++;
+            }
+        }
+
+        if (UNLIKELY(value_end - p < (ptrdiff_t)sizeof(int32_t)))
+            continue;
 
         STRING_SWITCH_L(p) {
         case HTTP_HDR_ACCEPT:
@@ -587,6 +704,10 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
             helper->cookie.value = value;
             helper->cookie.len = length;
             break;
+        CASE_HEADER(HTTP_HDR_EXPECT, "Expect")
+            helper->expect.value = value;
+            helper->expect.len = length;
+            break;
         CASE_HEADER(HTTP_HDR_IF_MODIFIED_SINCE, "If-Modified-Since")
             helper->if_modified_since.value = value;
             helper->if_modified_since.len = length;
@@ -595,18 +716,13 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
             helper->range.value = value;
             helper->range.len = length;
             break;
-        default:
-            STRING_SWITCH_SMALL(p) {
-            case HTTP_HDR_REQUEST_END:
-                *p = '\0';
-                helper->next_request = p + sizeof("\r\n") - 1;
-                return p;
-            }
-        }
-did_not_match:
-        p = memchr(p, '\n', (size_t)(buffer_end - p));
-        if (!p)
+        CASE_HEADER(HTTP_HDR_TRANSFER_ENCODING, "Transfer-Encoding")
+            helper->transfer_encoding.value = value;
+            helper->transfer_encoding.len = length;
             break;
+        }
+next_line:
+        ;
     }
 
     return buffer;
@@ -718,33 +834,22 @@ static enum lwan_http_status read_from_request_socket(struct lwan_request *reque
     int n_packets = 0;
 
     if (helper->next_request) {
-        buffer->len -= (size_t)(helper->next_request - buffer->value);
-        /* FIXME: This memmove() could be eventually removed if a better
-         * stucture were used for the request buffer. */
-        memmove(buffer->value, helper->next_request, buffer->len);
+        /* Buffer already holds (part of) a pipelined request */
         total_read = buffer->len;
         goto try_to_finalize;
     }
 
     for (; ; n_packets++) {
-        n = read(request->fd, buffer->value + total_read,
-                    (size_t)(buffer_size - total_read));
+        n = lwan_recv(request, buffer->value + total_read,
+                      (size_t)(buffer_size - total_read), 0);
         /* Client has shutdown orderly, nothing else to do; kill coro */
         if (UNLIKELY(n == 0)) {
+            lwan_response_batch_flush(request);
             coro_yield(request->conn->coro, CONN_CORO_ABORT);
             __builtin_unreachable();
         }
 
         if (UNLIKELY(n < 0)) {
-            switch (errno) {
-            case EAGAIN:
-            case EINTR:
-yield_and_read_again:
-                request->conn->flags |= CONN_MUST_READ;
-                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-                continue;
-            }
-
             /* Unexpected error before reading anything */
             if (UNLIKELY(!total_read))
                 return HTTP_BAD_REQUEST;
@@ -757,6 +862,10 @@ yield_and_read_again:
         total_read += (size_t)n;
         buffer->len = (size_t)total_read;
 
+        /* First bytes of a request: deadline to read the header starts now */
+        if ((request->conn->flags & CONN_PHASE_MASK) == CONN_PHASE_KEEP_ALIVE)
+            lwan_connection_set_phase(request->conn, CONN_PHASE_HEADER);
+
 try_to_finalize:
         switch (finalizer(total_read, buffer_size, helper, n_packets)) {
         case FINALIZER_DONE:
@@ -766,7 +875,11 @@ try_to_finalize:
         case FINALIZER_TRY_AGAIN:
             continue;
         case FINALIZER_YIELD_TRY_AGAIN:
-            goto yield_and_read_again;
+            /* Client might be waiting for these before sending more */
+            lwan_response_batch_flush(request);
+            request->conn->flags |= CONN_MUST_READ;
+            coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+            continue;
         case FINALIZER_ERROR_TOO_LARGE:
             return HTTP_TOO_LARGE;
         case FINALIZER_ERROR_TIMEOUT:
@@ -783,6 +896,9 @@ try_to_finalize:
 static enum lwan_read_finalizer read_request_finalizer(size_t total_read,
     size_t buffer_size, struct request_parser_helper *helper, int n_packets)
 {
+    /* Pipelined bytes, if any, are now part of the buffer being read */
+    helper->next_request = NULL;
+
     /* 16 packets should be enough to read a request (without the body, as
      * is the case for POST requests).  This yields a timeout error to avoid
      * clients being intentionally slow and hogging the server.  */
@@ -792,28 +908,202 @@ static enum lwan_read_finalizer read_request_finalizer(size_t total_read,
     if (UNLIKELY(total_read < 4))
         return FINALIZER_YIELD_TRY_AGAIN;
 
+    /* Pipelined requests are scanned as well, as they might have been
+     * only partially read.  Only bytes not seen by a previous call are
+     * looked at; line ends are kept for parse_headers().  */
+    if (LIKELY(lwan_scan_lines(&helper->scan, helper->buffer->value,
+                               helper->buffer->len)))
+        return FINALIZER_DONE;
+
     if (UNLIKELY(total_read == buffer_size))
         return FINALIZER_ERROR_TOO_LARGE;
 
-    if (LIKELY(helper->next_request)) {
-        helper->next_request = NULL;
-        return FINALIZER_DONE;
+    return FINALIZER_TRY_AGAIN;
+}
+
+static ALWAYS_INLINE int max(int a, int b)
+{
+    return (a > b) ? a : b;
+}
+
+static ALWAYS_INLINE int calculate_n_packets(size_t total)
+{
+    /* 740 = 1480 (a common MTU) / 2, so that Lwan'll optimistically error out
+     * after ~2x number of expected packets to fully read the request body.*/
+    return max(1, (int)(total / 740));
+}
+
+#define REQUEST_BUFFER_POOL_SIZE 16
+
+static const size_t request_buffer_sizes[] = {
+    4 * DEFAULT_BUFFER_SIZE,
+    16 * DEFAULT_BUFFER_SIZE,
+};
+
+static __thread struct {
+    void *free;
+    unsigned int count;
+} request_buffer_pool[N_ELEMENTS(request_buffer_sizes)];
+
+static void *
+request_buffer_pool_get(size_t size_class)
+{
+    void *buffer = request_buffer_pool[size_class].free;
+
+    if (buffer) {
+        memcpy(&request_buffer_pool[size_class].free, buffer, sizeof(void *));
+        request_buffer_pool[size_class].count--;
+        return buffer;
     }
 
-    /* FIXME: Would saving the location of CRLFCRLF be useful? Maybe
-     * parse_headers() could benefit from this information?  How would it
-     * compare to helper->next_request?  */
-    if (LIKELY(memmem(helper->buffer->value, helper->buffer->len, "\r\n\r\n", 4)))
-        return FINALIZER_DONE;
+    return malloc(request_buffer_sizes[size_class]);
+}
 
-    return FINALIZER_TRY_AGAIN;
+static void
+request_buffer_pool_put(size_t size_class, void *buffer)
+{
+    if (request_buffer_pool[size_class].count >= REQUEST_BUFFER_POOL_SIZE) {
+        free(buffer);
+        return;
+    }
+
+    memcpy(buffer, &request_buffer_pool[size_class].free, sizeof(void *));
+    request_buffer_pool[size_class].free = buffer;
+    request_buffer_pool[size_class].count++;
 }
 
-static ALWAYS_INLINE enum lwan_http_status
-read_request(struct lwan_request *request, struct request_parser_helper *helper)
+static size_t
+request_buffer_size_class(size_t size)
 {
-    return read_from_request_socket(request, helper->buffer, helper,
-                        DEFAULT_BUFFER_SIZE, read_request_finalizer);
+    for (size_t i = 0; i < N_ELEMENTS(request_buffer_sizes); i++) {
+        if (request_buffer_sizes[i] == size)
+            return i;
+    }
+
+    __builtin_unreachable();
+}
+
+void
+lwan_request_buffer_pool_drain(void)
+{
+    for (size_t i = 0; i < N_ELEMENTS(request_buffer_sizes); i++) {
+        void *buffer = request_buffer_pool[i].free;
+
+        while (buffer) {
+            void *next;
+
+            memcpy(&next, buffer, sizeof(void *));
+            free(buffer);
+            buffer = next;
+        }
+
+        request_buffer_pool[i].free = NULL;
+        request_buffer_pool[i].count = 0;
+    }
+}
+
+void
+lwan_request_buffer_init(struct lwan_request_buffer *buffer, char *initial)
+{
+    buffer->value = buffer->initial = initial;
+    buffer->len = 0;
+    buffer->size = DEFAULT_BUFFER_SIZE;
+}
+
+/* Gives a buffer taken from the pool back; must only be called when there
+ * are no pipelined requests in it */
+void
+lwan_request_buffer_release(struct lwan_request_buffer *buffer)
+{
+    if (buffer->value != buffer->initial) {
+        request_buffer_pool_put(request_buffer_size_class(buffer->size),
+            buffer->value);
+        buffer->value = buffer->initial;
+        buffer->size = DEFAULT_BUFFER_SIZE;
+    }
+
+    buffer->len = 0;
+}
+
+static bool
+grow_request_buffer(struct lwan_request_buffer *buffer, size_t limit)
+{
+    if (buffer->size >= limit)
+        return false;
+
+    for (size_t i = 0; i < N_ELEMENTS(request_buffer_sizes); i++) {
+        if (request_buffer_sizes[i] <= buffer->size)
+            continue;
+
+        char *new_value = request_buffer_pool_get(i);
+        if (UNLIKELY(!new_value))
+            return false;
+
+        memcpy(new_value, buffer->value, buffer->len);
+        if (buffer->value != buffer->initial) {
+            request_buffer_pool_put(request_buffer_size_class(buffer->size),
+                buffer->value);
+        }
+
+        buffer->value = new_value;
+        buffer->size = request_buffer_sizes[i];
+        return true;
+    }
+
+    return false;
+}
+
+/* Pipelined requests are parsed in place, with helper->buffer pointing
+ * to the current one (and whatever follows it) in the storage buffer;
+ * they're moved to the beginning of the storage only if the space left
+ * after them isn't enough to finish reading them.  */
+static enum lwan_http_status
+read_request(struct lwan_request *request, struct request_parser_helper *helper,
+    struct lwan_request_buffer *storage)
+{
+    const size_t limit = request->conn->thread->lwan->config.max_request_header_size;
+    struct lwan_value *window = helper->buffer;
+    char *storage_end = storage->value + storage->len;
+    enum lwan_http_status status;
+
+    if (helper->next_request && helper->next_request < storage_end) {
+        window->value = helper->next_request;
+        window->len = (size_t)(storage_end - helper->next_request);
+        lwan_connection_set_phase(request->conn, CONN_PHASE_HEADER);
+    } else {
+        window->value = storage->value;
+        window->len = 0;
+        helper->next_request = NULL;
+
+        /* New connections are waiting for their first header since they
+         * were accepted: don't give them a fresh deadline */
+        if ((request->conn->flags & CONN_PHASE_MASK) != CONN_PHASE_HEADER)
+            lwan_connection_set_phase(request->conn, CONN_PHASE_KEEP_ALIVE);
+    }
+
+    while (true) {
+        const size_t offset = (size_t)(window->value - storage->value);
+        const size_t size = storage->size < limit ? storage->size : limit;
+
+        helper->error_when_n_packets = calculate_n_packets(size);
+
+        /* One byte is kept for the NUL terminator */
+        status = read_from_request_socket(request, window, helper,
+            size - offset - 1, read_request_finalizer);
+        storage->len = offset + window->len;
+
+        if (LIKELY(status != HTTP_TOO_LARGE))
+            return status;
+
+        if (offset) {
+            memmove(storage->value, window->value, window->len);
+            storage->len = window->len;
+        } else if (!grow_request_buffer(storage, limit)) {
+            return status;
+        }
+
+        window->value = helper->next_request = storage->value;
+    }
 }
 
 static enum lwan_read_finalizer post_data_finalizer(size_t total_read,
@@ -824,7 +1114,7 @@ static enum lwan_read_finalizer post_data_finalizer(size_t total_read,
 
     /* For POST requests, the body can be larger, and due to small MTUs on
      * most ethernet connections, responding with a timeout solely based on
-     * number of packets doesn't work.  Use keepalive timeout instead.  */
+     * number of packets doesn't work.  Use the body timeout instead.  */
     if (UNLIKELY(time(NULL) > helper->error_when_time))
         return FINALIZER_ERROR_TIMEOUT;
 
@@ -836,18 +1126,6 @@ static enum lwan_read_finalizer post_data_finalizer(size_t total_read,
     return FINALIZER_TRY_AGAIN;
 }
 
-static ALWAYS_INLINE int max(int a, int b)
-{
-    return (a > b) ? a : b;
-}
-
-static ALWAYS_INLINE int calculate_n_packets(size_t total)
-{
-    /* 740 = 1480 (a common MTU) / 2, so that Lwan'll optimistically error out
-     * after ~2x number of expected packets to fully read the request body.*/
-    return max(1, (int)(total / 740));
-}
-
 static const char *
 get_abs_path_env(const char *var)
 {
@@ -882,8 +1160,8 @@ get_temp_dir(void)
     return NULL;
 }
 
-static int
-create_temp_file(void)
+int
+lwan_create_temp_file(void)
 {
     char template[PATH_MAX];
     const char *tmpdir;
@@ -946,7 +1224,7 @@ alloc_post_buffer(struct coro *coro, size_t size, bool allow_file)
     if (UNLIKELY(!allow_file))
         return NULL;
 
-    fd = create_temp_file();
+    fd = lwan_create_temp_file();
     if (UNLIKELY(fd < 0))
         return NULL;
 
@@ -976,24 +1254,348 @@ alloc_post_buffer(struct coro *coro, size_t size, bool allow_file)
     return ptr;
 }
 
+static size_t
+chunked_min_remaining(const struct chunked_decoder *chunked)
+{
+    /* Fewest bytes that must still belong to the body in each state (the
+     * shortest possible ending being "0\r\n\r\n").  Never reading more
+     * than this from the socket ensures the next request isn't consumed.  */
+    switch (chunked->state) {
+    case CHUNKED_SIZE_START:
+        return 5;
+    case CHUNKED_SIZE:
+    case CHUNKED_EXTENSION:
+        return chunked->size ? chunked->size + 9 : 4;
+    case CHUNKED_SIZE_LF:
+        return chunked->size ? chunked->size + 8 : 3;
+    case CHUNKED_DATA:
+        return chunked->size + 7;
+    case CHUNKED_DATA_CR:
+        return 7;
+    case CHUNKED_DATA_LF:
+        return 6;
+    case CHUNKED_TRAILER_START:
+        return 2;
+    case CHUNKED_TRAILER:
+        return 4;
+    case CHUNKED_TRAILER_LF:
+        return 3;
+    case CHUNKED_END_LF:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Removes the chunked framing from buffer[0..len) in place, returning how
+ * many bytes of the body are now at its start, or -1 on malformed input. */
+static ssize_t
+decode_chunked(struct chunked_decoder *chunked, char *buffer, size_t len)
+{
+    const char *in = buffer;
+    const char *end = buffer + len;
+    char *out = buffer;
+
+    while (in < end) {
+        const char c = *in;
+
+        switch (chunked->state) {
+        case CHUNKED_DATA: {
+            size_t n = (size_t)(end - in);
+
+            if (n > chunked->size)
+                n = chunked->size;
+            if (out != in)
+                memmove(out, in, n);
+
+            out += n;
+            in += n;
+            chunked->size -= n;
+            if (!chunked->size)
+                chunked->state = CHUNKED_DATA_CR;
+            continue;
+        }
+        case CHUNKED_SIZE_START:
+        case CHUNKED_SIZE:
+            if (lwan_char_isxdigit(c)) {
+                if (UNLIKELY(chunked->size > (SIZE_MAX >> 5)))
+                    goto error;
+                chunked->size = chunked->size * 16 + (size_t)decode_hex_digit(c);
+                chunked->state = CHUNKED_SIZE;
+                break;
+            }
+            if (UNLIKELY(chunked->state == CHUNKED_SIZE_START))
+                goto error;
+
+            if (c == ';' || c == ' ' || c == '\t')
+                chunked->state = CHUNKED_EXTENSION;
+            else if (LIKELY(c == '\r'))
+                chunked->state = CHUNKED_SIZE_LF;
+            else
+                goto error;
+            break;
+        case CHUNKED_EXTENSION:
+            /* Extensions are ignored */
+            if (c == '\r')
+                chunked->state = CHUNKED_SIZE_LF;
+            else if (UNLIKELY(c == '\n'))
+                goto error;
+            break;
+        case CHUNKED_SIZE_LF:
+            if (UNLIKELY(c != '\n'))
+                goto error;
+            chunked->state = chunked->size ? CHUNKED_DATA : CHUNKED_TRAILER_START;
+            break;
+        case CHUNKED_DATA_CR:
+            if (UNLIKELY(c != '\r'))
+                goto error;
+            chunked->state = CHUNKED_DATA_LF;
+            break;
+        case CHUNKED_DATA_LF:
+            if (UNLIKELY(c != '\n'))
+                goto error;
+            chunked->state = CHUNKED_SIZE_START;
+            break;
+        case CHUNKED_TRAILER_START:
+            /* Trailers are ignored as well */
+            if (c == '\r')
+                chunked->state = CHUNKED_END_LF;
+            else if (LIKELY(c != '\n'))
+                chunked->state = CHUNKED_TRAILER;
+            else
+                goto error;
+            break;
+        case CHUNKED_TRAILER:
+            if (c == '\r')
+                chunked->state = CHUNKED_TRAILER_LF;
+            else if (UNLIKELY(c == '\n'))
+                goto error;
+            break;
+        case CHUNKED_TRAILER_LF:
+            if (UNLIKELY(c != '\n'))
+                goto error;
+            chunked->state = CHUNKED_TRAILER_START;
+            break;
+        case CHUNKED_END_LF:
+            if (UNLIKELY(c != '\n'))
+                goto error;
+            chunked->state = CHUNKED_DONE;
+            break;
+        default:
+            goto error;
+        }
+
+        in++;
+    }
+
+    return (ssize_t)(out - buffer);
+
+error:
+    chunked->state = CHUNKED_ERROR;
+    return -1;
+}
+
+static void
+send_continue(struct lwan_request *request, struct request_parser_helper *helper)
+{
+    static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    helper->expect_continue = false;
+    lwan_send(request, continue_response, sizeof(continue_response) - 1, 0);
+}
+
+static ssize_t
+read_raw_body(struct lwan_request *request, struct request_parser_helper *helper,
+    char *buffer, size_t len)
+{
+    if (helper->next_request) {
+        /* Part of the body might have been read with the header */
+        char *buffer_end = helper->buffer->value + helper->buffer->len;
+        size_t have = (size_t)(buffer_end - helper->next_request);
+
+        if (have) {
+            if (len > have)
+                len = have;
+
+            memcpy(buffer, helper->next_request, len);
+            helper->next_request += len;
+            return (ssize_t)len;
+        }
+
+        helper->next_request = NULL;
+    }
+
+    /* Client won't send the body before being told to */
+    if (UNLIKELY(helper->expect_continue))
+        send_continue(request, helper);
+    else
+        lwan_response_batch_flush(request);
+
+    lwan_connection_set_phase(request->conn, CONN_PHASE_BODY);
+
+    ssize_t n = lwan_recv(request, buffer, len, 0);
+    if (LIKELY(n > 0)) {
+        request->conn->flags &= ~CONN_MUST_READ;
+        return n;
+    }
+
+    /* Client has shutdown before sending the whole body, or some error */
+    return -1;
+}
+
+static ssize_t
+read_body(struct lwan_request *request, struct request_parser_helper *helper,
+    char *buffer, size_t len)
+{
+    ssize_t n;
+
+    if (helper->chunked.state == CHUNKED_NONE) {
+        if (!helper->body_remaining)
+            return 0;
+        if (len > helper->body_remaining)
+            len = helper->body_remaining;
+
+        n = read_raw_body(request, helper, buffer, len);
+        if (LIKELY(n > 0))
+            helper->body_remaining -= (size_t)n;
+        return n;
+    }
+
+    /* Reads that only had chunk framing in them decode to nothing */
+    while (helper->chunked.state != CHUNKED_DONE) {
+        size_t want = chunked_min_remaining(&helper->chunked);
+
+        if (UNLIKELY(!want))
+            return -1;
+        if (want > len)
+            want = len;
+
+        n = read_raw_body(request, helper, buffer, want);
+        if (UNLIKELY(n < 0)) {
+            helper->chunked.state = CHUNKED_ERROR;
+            return -1;
+        }
+
+        n = decode_chunked(&helper->chunked, buffer, (size_t)n);
+        if (n)
+            return n;
+    }
+
+    return 0;
+}
+
+static ALWAYS_INLINE bool
+body_is_pending(const struct request_parser_helper *helper)
+{
+    if (helper->chunked.state == CHUNKED_NONE)
+        return helper->body_remaining > 0;
+    return helper->chunked.state != CHUNKED_DONE;
+}
+
+static void
+free_chunked_post_buffer(void *data)
+{
+    char **buffer = data;
+
+    free(*buffer);
+    free(buffer);
+}
+
+static enum lwan_http_status
+read_chunked_post_data(struct lwan_request *request,
+    struct request_parser_helper *helper, size_t max_post_data_size)
+{
+    size_t len = 0, size = DEFAULT_BUFFER_SIZE;
+    char **buffer;
+
+    if (size > max_post_data_size)
+        size = max_post_data_size;
+
+    /* Grown with realloc(), so only the latest one is kept around */
+    buffer = coro_malloc_full(request->conn->coro, sizeof(*buffer),
+        free_chunked_post_buffer);
+    if (UNLIKELY(!buffer)) {
+        helper->chunked.state = CHUNKED_ERROR;
+        return HTTP_INTERNAL_ERROR;
+    }
+    *buffer = malloc(size + 1);
+    if (UNLIKELY(!*buffer)) {
+        helper->chunked.state = CHUNKED_ERROR;
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    /* The size isn't known upfront: raw chunks are read straight into a
+     * growing buffer and decoded there.  */
+    while (true) {
+        ssize_t n;
+
+        if (len == size) {
+            char *new_buffer;
+
+            if (UNLIKELY(size >= max_post_data_size)) {
+                char c;
+
+                /* Only too large if there's more than that */
+                n = read_body(request, helper, &c, 1);
+                if (UNLIKELY(n < 0))
+                    return HTTP_BAD_REQUEST;
+                if (!n)
+                    break;
+
+                helper->chunked.state = CHUNKED_ERROR;
+                return HTTP_TOO_LARGE;
+            }
+
+            size *= 2;
+            if (size > max_post_data_size)
+                size = max_post_data_size;
+
+            new_buffer = realloc(*buffer, size + 1);
+            if (UNLIKELY(!new_buffer)) {
+                helper->chunked.state = CHUNKED_ERROR;
+                return HTTP_INTERNAL_ERROR;
+            }
+            *buffer = new_buffer;
+        }
+
+        n = read_body(request, helper, *buffer + len, size - len);
+        if (UNLIKELY(n < 0))
+            return HTTP_BAD_REQUEST;
+        if (!n)
+            break;
+
+        len += (size_t)n;
+    }
+
+    (*buffer)[len] = '\0';
+    helper->post_data.value = *buffer;
+    helper->post_data.len = len;
+
+    return HTTP_OK;
+}
+
 static enum lwan_http_status
 read_post_data(struct lwan_request *request, struct request_parser_helper *helper)
 {
     /* Holy indirection, Batman! */
     struct lwan_config *config = &request->conn->thread->lwan->config;
-    const size_t max_post_data_size = config->max_post_data_size;
+    const size_t post_data_size = helper->body_remaining;
+    enum lwan_http_status status;
     char *new_buffer;
-    long parsed_size;
+
+    /* Already read if this is a rewritten request */
+    if (helper->post_data.value)
+        return HTTP_OK;
+
+    if (helper->chunked.state != CHUNKED_NONE)
+        return read_chunked_post_data(request, helper,
+            config->max_post_data_size);
 
     if (UNLIKELY(!helper->content_length.value))
         return HTTP_BAD_REQUEST;
-    parsed_size = parse_long(helper->content_length.value, -1);
-    if (UNLIKELY(parsed_size < 0))
-        return HTTP_BAD_REQUEST;
-    if (UNLIKELY(parsed_size >= (long)max_post_data_size))
+    if (UNLIKELY(post_data_size >= config->max_post_data_size))
         return HTTP_TOO_LARGE;
 
-    size_t post_data_size = (size_t)parsed_size;
     size_t have;
     if (!helper->next_request) {
         have = 0;
@@ -1005,6 +1607,7 @@ read_post_data(struct lwan_request *request, struct request_parser_helper *helpe
             helper->post_data.value = helper->next_request;
             helper->post_data.len = post_data_size;
             helper->next_request += post_data_size;
+            helper->body_remaining = 0;
             return HTTP_OK;
         }
     }
@@ -1020,12 +1623,71 @@ read_post_data(struct lwan_request *request, struct request_parser_helper *helpe
         new_buffer = mempcpy(new_buffer, helper->next_request, have);
     helper->next_request = NULL;
 
-    helper->error_when_time = time(NULL) + config->keep_alive_timeout;
+    helper->error_when_time = time(NULL) + config->read_body_timeout;
     helper->error_when_n_packets = calculate_n_packets(post_data_size);
 
+    if (UNLIKELY(helper->expect_continue))
+        send_continue(request, helper);
+
+    lwan_connection_set_phase(request->conn, CONN_PHASE_BODY);
+
     struct lwan_value buffer = { .value = new_buffer, .len = post_data_size - have };
-    return read_from_request_socket(request, &buffer, helper, buffer.len,
+    status = read_from_request_socket(request, &buffer, helper, buffer.len,
         post_data_finalizer);
+
+    /* If reading failed, it's not known how much of the body is still
+     * in flight: make sure the connection isn't reused.  */
+    if (LIKELY(status == HTTP_OK))
+        helper->body_remaining = 0;
+    else
+        helper->chunked.state = CHUNKED_ERROR;
+    return status;
+}
+
+static void
+discard_body(struct lwan_request *request, struct request_parser_helper *helper)
+{
+    const size_t max_post_data_size =
+        request->conn->thread->lwan->config.max_post_data_size;
+    size_t discarded = 0;
+    char buffer[1024];
+
+    /* The client was never told to send the body, so it might or might
+     * not do so: where the next request starts can't be known.  */
+    if (UNLIKELY(helper->expect_continue) && body_is_pending(helper))
+        goto abort;
+
+    /* Bodies that weren't consumed by the handler are skipped, so that
+     * the next request in the pipeline can be read.  Those that are too
+     * large to bother (or that can't be read) close the connection.  */
+    while (body_is_pending(helper)) {
+        ssize_t n;
+
+        if (!helper->next_request &&
+                helper->body_remaining + discarded > max_post_data_size)
+            goto abort;
+
+        n = read_body(request, helper, buffer, sizeof(buffer));
+        if (UNLIKELY(n < 0))
+            goto abort;
+        discarded += (size_t)n;
+    }
+
+    return;
+
+abort:
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static ALWAYS_INLINE void
+refuse_expected_body(struct lwan_request *request,
+    struct request_parser_helper *helper)
+{
+    /* Responding without asking for the body: the connection is going to
+     * be closed by discard_body(), so let the client know.  */
+    if (UNLIKELY(helper->expect_continue) && body_is_pending(helper))
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
 }
 
 static char *
@@ -1069,7 +1731,8 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
 
-    buffer = parse_headers(helper, buffer, helper->buffer->value + helper->buffer->len);
+    buffer = parse_headers(helper, buffer,
+        helper->buffer->value + helper->scan.terminator);
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
 
@@ -1078,6 +1741,27 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
         return HTTP_BAD_REQUEST;
     request->original_url.len = request->url.len = (size_t)decoded_len;
 
+    if (helper->transfer_encoding.value) {
+        /* Only "chunked" is understood; a Content-Length as well could be
+         * an attempt to smuggle a request past a proxy.  */
+        if (helper->content_length.value)
+            return HTTP_BAD_REQUEST;
+        if (UNLIKELY(strcasecmp(helper->transfer_encoding.value, "chunked")))
+            return HTTP_NOT_IMPLEMENTED;
+
+        helper->chunked.state = CHUNKED_SIZE_START;
+    } else if (helper->content_length.value) {
+        long parsed_size = parse_long(helper->content_length.value, -1);
+
+        if (UNLIKELY(parsed_size < 0))
+            return HTTP_BAD_REQUEST;
+        helper->body_remaining = (size_t)parsed_size;
+    }
+
+    /* HTTP/1.0 clients don't know about interim responses */
+    if (helper->expect.value && !(request->flags & REQUEST_IS_HTTP_1_0))
+        helper->expect_continue = !strcasecmp(helper->expect.value, "100-continue");
+
     compute_keep_alive_flag(request, helper);
 
     return HTTP_OK;
@@ -1099,8 +1783,14 @@ prepare_for_response(struct lwan_url_map *url_map,
             return HTTP_NOT_AUTHORIZED;
     }
 
-    if (url_map->flags & HANDLER_PARSE_QUERY_STRING)
-        parse_query_string(request, helper);
+    /* Key/value pairs are only split when a handler looks them up */
+    key_value_list_init(&request->query_params,
+        (url_map->flags & HANDLER_PARSE_QUERY_STRING) ? helper->query_string
+                                                      : (struct lwan_value){});
+    key_value_list_init(&request->cookies,
+        (url_map->flags & HANDLER_PARSE_COOKIES) ? helper->cookie
+                                                 : (struct lwan_value){});
+    key_value_list_init(&request->post_data, (struct lwan_value){});
 
     if (url_map->flags & HANDLER_PARSE_IF_MODIFIED_SINCE)
         parse_if_modified_since(request, helper);
@@ -1111,9 +1801,6 @@ prepare_for_response(struct lwan_url_map *url_map,
     if (url_map->flags & HANDLER_PARSE_ACCEPT_ENCODING)
         parse_accept_encoding(request, helper);
 
-    if (url_map->flags & HANDLER_PARSE_COOKIES)
-        parse_cookies(request, helper);
-
     if (url_map->flags & HANDLER_REMOVE_LEADING_SLASH) {
         while (*request->url.value == '/' && request->url.len > 0) {
             ++request->url.value;
@@ -1124,20 +1811,27 @@ prepare_for_response(struct lwan_url_map *url_map,
     if (lwan_request_get_method(request) == REQUEST_METHOD_POST) {
         enum lwan_http_status status;
 
-        if (!(url_map->flags & HANDLER_PARSE_POST_DATA)) {
-            /* FIXME: Discard POST data here? If a POST request is sent
-             * to a handler that is not supposed to handle a POST request,
-             * the next request in the pipeline will fail because the
-             * body of the previous request will be used as the next
-             * request itself. */
-            return HTTP_NOT_ALLOWED;
+        if (url_map->flags & HANDLER_STREAM_BODY) {
+            /* Handler reads the body with lwan_request_read_body() */
+            if (UNLIKELY(!helper->content_length.value &&
+                         helper->chunked.state == CHUNKED_NONE))
+                return HTTP_BAD_REQUEST;
+
+            request->header.content_type = &helper->content_type;
+            if (CONTENT_TYPE_IS(helper, "multipart/form-data"))
+                helper->multipart_pending = true;
+            return HTTP_OK;
         }
 
+        /* The body is discarded after the response is sent */
+        if (!(url_map->flags & HANDLER_PARSE_POST_DATA))
+            return HTTP_NOT_ALLOWED;
+
         status = read_post_data(request, helper);
         if (UNLIKELY(status != HTTP_OK))
             return status;
 
-        parse_post_data(request, helper);
+        prepare_post_data(request, helper);
     }
 
     return HTTP_OK;
@@ -1162,18 +1856,18 @@ handle_rewrite(struct lwan_request *request, struct request_parser_helper *helpe
 
 char *
 lwan_process_request(struct lwan *l, struct lwan_request *request,
-    struct lwan_value *buffer, char *next_request)
+    struct lwan_request_buffer *buffer, char *next_request)
 {
     enum lwan_http_status status;
     struct lwan_url_map *url_map;
 
+    struct lwan_value window;
     struct request_parser_helper helper = {
-        .buffer = buffer,
+        .buffer = &window,
         .next_request = next_request,
-        .error_when_n_packets = calculate_n_packets(DEFAULT_BUFFER_SIZE)
     };
 
-    status = read_request(request, &helper);
+    status = read_request(request, &helper, buffer);
     if (UNLIKELY(status != HTTP_OK)) {
         /* This request was bad, but maybe there's a good one in the
          * pipeline.  */
@@ -1190,10 +1884,17 @@ lwan_process_request(struct lwan *l, struct lwan_request *request,
 
     status = parse_http_request(request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
+        /* Where the body ends isn't known yet, so what follows can't be
+         * trusted to be another request (it could be smuggled in the
+         * body): close the connection after the response.  */
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
         lwan_default_response(request, status);
-        goto out;
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
     }
 
+    request->helper = &helper;
+
 lookup_again:
     url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
     if (UNLIKELY(!url_map)) {
@@ -1203,6 +1904,7 @@ lookup_again:
 
     status = prepare_for_response(url_map, request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
+        refuse_expected_body(request, &helper);
         lwan_default_response(request, status);
         goto out;
     }
@@ -1216,22 +1918,157 @@ lookup_again:
         }
     }
 
+    refuse_expected_body(request, &helper);
     lwan_response(request, status);
 
 out:
+    discard_body(request, &helper);
     return helper.next_request;
 }
 
-static inline void *
-value_lookup(const struct lwan_key_value_array *array, const char *key)
+bool
+lwan_request_is_pipelined(const struct lwan_request *request)
+{
+    const struct request_parser_helper *helper = request->helper;
+
+    if (!helper || !helper->next_request || body_is_pending(helper))
+        return false;
+
+    return helper->next_request < helper->buffer->value + helper->buffer->len;
+}
+
+ssize_t
+lwan_request_read_body(struct lwan_request *request, void *buffer, size_t len)
+{
+    ssize_t n = read_body(request, request->helper, buffer, len);
+
+    /* Streamed bodies can be of any size, so the body timeout is counted
+     * from the last time something was read, not from the first.  */
+    if (n > 0)
+        request->conn->flags |= CONN_PHASE_CHANGED;
+
+    return n;
+}
+
+ssize_t
+lwan_request_peek_body(struct lwan_request *request, char *buffer, size_t len)
+{
+#if defined(HAS_SPLICE)
+    struct request_parser_helper *helper = request->helper;
+    ssize_t n;
+
+    if (helper->chunked.state != CHUNKED_NONE)
+        return 0;
+    if (helper->next_request &&
+            helper->next_request < helper->buffer->value + helper->buffer->len)
+        return 0;
+
+    if (len > helper->body_remaining)
+        len = helper->body_remaining;
+    if (!len)
+        return 0;
+
+    n = recv(request->fd, buffer, len, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 ? n : 0;
+#else
+    (void)request;
+    (void)buffer;
+    (void)len;
+
+    return 0;
+#endif
+}
+
+ssize_t
+lwan_request_splice_body(struct lwan_request *request, int pipefd[2],
+    int fd, size_t len)
+{
+#if defined(HAS_SPLICE)
+    struct request_parser_helper *helper = request->helper;
+    size_t total = 0;
+
+    if (UNLIKELY(len > helper->body_remaining))
+        return -1;
+
+    while (total < len) {
+        ssize_t in = splice(request->fd, NULL, pipefd[1], NULL, len - total,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (UNLIKELY(in <= 0)) {
+            if (in < 0 && (errno == EAGAIN || errno == EINTR)) {
+                if (errno == EAGAIN)
+                    request->conn->flags &= ~CONN_READABLE;
+                lwan_response_batch_flush(request);
+                request->conn->flags |= CONN_MUST_READ;
+                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                continue;
+            }
+
+            return -1;
+        }
+
+        helper->body_remaining -= (size_t)in;
+
+        for (ssize_t out_total = 0; out_total < in; ) {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL,
+                (size_t)(in - out_total), SPLICE_F_MOVE);
+
+            if (UNLIKELY(out <= 0)) {
+                if (out < 0 && errno == EINTR)
+                    continue;
+
+                /* What's in the pipe is lost: body can't be parsed anymore */
+                return -1;
+            }
+
+            out_total += out;
+        }
+
+        total += (size_t)in;
+    }
+
+    request->conn->flags &= ~CONN_MUST_READ;
+    request->conn->flags |= CONN_PHASE_CHANGED;
+    return (ssize_t)total;
+#else
+    (void)request;
+    (void)pipefd;
+    (void)fd;
+    (void)len;
+
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+static const struct lwan_key_value_list *
+key_value_list_get(struct lwan_request *request,
+    struct lwan_key_value_list *list,
+    ssize_t (*decode_value)(char *value), const char separator)
 {
-    const struct lwan_array *la = (const struct lwan_array *)array;
+    if (UNLIKELY(!list->base))
+        parse_key_values(request, list, decode_value, separator);
+
+    return list;
+}
 
-    if (LIKELY(la->elements)) {
+static const char *
+value_lookup(struct lwan_request *request, struct lwan_key_value_list *list,
+    ssize_t (*decode_value)(char *value), const char separator,
+    const char *key)
+{
+    key_value_list_get(request, list, decode_value, separator);
+
+    if (LIKELY(list->len <= LWAN_KEY_VALUE_LIST_INLINE)) {
+        for (unsigned int i = 0; i < list->len; i++) {
+            if (!strcmp(list->base[i].key, key))
+                return list->base[i].value;
+        }
+    } else {
         struct lwan_key_value k = { .key = (char *)key };
         struct lwan_key_value *entry;
 
-        entry = bsearch(&k, la->base, la->elements - 1, sizeof(k), key_value_compare);
+        entry = bsearch(&k, list->base, list->len, sizeof(k), key_value_compare);
         if (LIKELY(entry))
             return entry->value;
     }
@@ -1242,19 +2079,141 @@ value_lookup(const struct lwan_key_value_array *array, const char *key)
 const char *
 lwan_request_get_query_param(struct lwan_request *request, const char *key)
 {
-    return value_lookup(&request->query_params, key);
+    return value_lookup(request, &request->query_params, url_decode, '&', key);
+}
+
+static void
+parse_multipart(struct lwan_request *request)
+{
+    struct request_parser_helper *helper = request->helper;
+    struct lwan_key_value_list *list = &request->post_data;
+
+    if (LIKELY(!helper || !helper->multipart_pending))
+        return;
+    helper->multipart_pending = false;
+
+    list->base = list->inline_kv;
+    list->size = LWAN_KEY_VALUE_LIST_INLINE;
+    list->len = 0;
+
+    if (UNLIKELY(!lwan_multipart_parse(request, helper->content_type.value,
+                     helper->post_data.value ? &helper->post_data : NULL,
+                     list, &helper->files, &helper->n_files))) {
+        list->len = 0;
+        helper->n_files = 0;
+        return;
+    }
+
+    if (list->len > LWAN_KEY_VALUE_LIST_INLINE)
+        qsort(list->base, list->len, sizeof(*list->base), key_value_compare);
 }
 
 const char *
 lwan_request_get_post_param(struct lwan_request *request, const char *key)
 {
-    return value_lookup(&request->post_data, key);
+    parse_multipart(request);
+    return value_lookup(request, &request->post_data, url_decode, '&', key);
 }
 
 const char *
 lwan_request_get_cookie(struct lwan_request *request, const char *key)
 {
-    return value_lookup(&request->cookies, key);
+    return value_lookup(request, &request->cookies, identity_decode, ';', key);
+}
+
+const struct lwan_key_value_list *
+lwan_request_get_query_params(struct lwan_request *request)
+{
+    return key_value_list_get(request, &request->query_params, url_decode, '&');
+}
+
+const struct lwan_key_value_list *
+lwan_request_get_post_params(struct lwan_request *request)
+{
+    parse_multipart(request);
+    return key_value_list_get(request, &request->post_data, url_decode, '&');
+}
+
+const struct lwan_key_value_list *
+lwan_request_get_cookies(struct lwan_request *request)
+{
+    return key_value_list_get(request, &request->cookies, identity_decode, ';');
+}
+
+const struct lwan_multipart_file *
+lwan_request_get_post_file(struct lwan_request *request, const char *name)
+{
+    struct request_parser_helper *helper = request->helper;
+
+    parse_multipart(request);
+
+    if (UNLIKELY(!helper))
+        return NULL;
+
+    for (size_t i = 0; i < helper->n_files; i++) {
+        if (!strcmp(helper->files[i].name, name))
+            return &helper->files[i];
+    }
+
+    return NULL;
+}
+
+static ALWAYS_INLINE uint32_t
+known_header_slot(const char *name, size_t len)
+{
+    uint32_t slot = lwan_header_hash(name, len, HEADER_HASH_SEED) &
+                        (HEADER_TABLE_SIZE - 1);
+
+    if (header_table[slot].len == len &&
+            !strncasecmp(header_table[slot].name, name, len))
+        return slot;
+
+    return HEADER_TABLE_SIZE;
+}
+
+static void
+index_known_headers(struct lwan_header_index *index)
+{
+    memset(index->well_known, 0, sizeof(index->well_known));
+
+    for (uint8_t i = 0; i < index->n_headers; i++) {
+        uint32_t slot = known_header_slot(index->base + index->headers[i].name,
+                                          index->headers[i].name_len);
+
+        /* If a header is repeated, its first value is used */
+        if (slot < HEADER_TABLE_SIZE && !index->well_known[slot])
+            index->well_known[slot] = (uint8_t)(i + 1);
+    }
+
+    index->well_known_indexed = true;
+}
+
+const char *
+lwan_request_get_header(struct lwan_request *request, const char *header)
+{
+    struct lwan_header_index *index;
+    const size_t len = strlen(header);
+
+    if (UNLIKELY(!request->helper))
+        return NULL;
+    index = &request->helper->header_index;
+
+    uint32_t slot = known_header_slot(header, len);
+    if (LIKELY(slot < HEADER_TABLE_SIZE)) {
+        if (!index->well_known_indexed)
+            index_known_headers(index);
+
+        uint8_t i = index->well_known[slot];
+        return i ? index->base + index->headers[i - 1].value : NULL;
+    }
+
+    for (uint8_t i = 0; i < index->n_headers; i++) {
+        if (index->headers[i].name_len == len &&
+                !strncasecmp(index->base + index->headers[i].name, header, len))
+            return index->base + index->headers[i].value;
+    }
+
+    return NULL;
 }
 
 ALWAYS_INLINE int
@@ -20,6 +20,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <netinet/in.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -138,10 +139,17 @@ static const bool has_response_body[REQUEST_METHOD_MASK] = {
     [REQUEST_METHOD_POST] = true,
 };
 
+static void
+free_body(void *data1, void *data2 __attribute__((unused)))
+{
+    free(data1);
+}
+
 void
 lwan_response(struct lwan_request *request, enum lwan_http_status status)
 {
-    char headers[DEFAULT_HEADERS_SIZE];
+    char headers_buffer[DEFAULT_HEADERS_SIZE];
+    char *headers = headers_buffer;
 
     if (request->flags & RESPONSE_CHUNKED_ENCODING) {
         /* Send last, 0-sized chunk */
@@ -179,28 +187,44 @@ lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
-    size_t header_len = lwan_prepare_response_header(request, status, headers, sizeof(headers));
+    size_t header_len = lwan_prepare_response_header_growable(request, status,
+        &headers, sizeof(headers_buffer));
     if (UNLIKELY(!header_len)) {
         lwan_default_response(request, HTTP_INTERNAL_ERROR);
         return;
     }
 
-    if (has_response_body[lwan_request_get_method(request)]) {
-        struct iovec response_vec[] = {
-            {
-                .iov_base = headers,
-                .iov_len = header_len
-            },
-            {
-                .iov_base = strbuf_get_buffer(request->response.buffer),
-                .iov_len = strbuf_get_length(request->response.buffer)
-            }
-        };
+    struct iovec response_vec[] = {
+        {
+            .iov_base = headers,
+            .iov_len = header_len
+        },
+        {
+            .iov_base = strbuf_get_buffer(request->response.buffer),
+            .iov_len = strbuf_get_length(request->response.buffer)
+        }
+    };
+    int iov_count = has_response_body[lwan_request_get_method(request)] ? 2 : 1;
 
-        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
-    } else {
-        lwan_send(request, headers, header_len, 0);
+    /* Another request is waiting to be handled: send both responses later */
+    if (lwan_request_is_pipelined(request) &&
+            lwan_response_batch_add(request, response_vec, iov_count))
+        return;
+
+    /* Large bodies can be sent without copying them: the buffer is taken
+     * from the strbuf and freed once the kernel is done with it */
+    if (iov_count == 2 &&
+            lwan_can_send_zerocopy(request, response_vec[1].iov_len)) {
+        char *body = strbuf_detach(request->response.buffer);
+
+        if (body) {
+            lwan_send_zerocopy(request, headers, header_len, body,
+                response_vec[1].iov_len, free_body, body, NULL);
+            return;
+        }
     }
+
+    lwan_writev(request, response_vec, iov_count);
 }
 
 void
@@ -217,8 +241,40 @@ lwan_default_response(struct lwan_request *request, enum lwan_http_status status
     lwan_response(request, status);
 }
 
+/* Headers start in the buffer given by the caller, and are moved to a larger
+ * one, allocated in the coroutine, if they don't fit and that's allowed */
+#define MAX_HEADERS_SIZE (128 * DEFAULT_HEADERS_SIZE)
+
+static bool
+grow_headers(struct lwan_request *request, char **headers, char **p_headers,
+    char **p_headers_end, size_t needed)
+{
+    size_t used = (size_t)(*p_headers - *headers);
+    size_t size = (size_t)(*p_headers_end - *headers) * 2;
+    char *new_headers;
+
+    while (size <= used + needed)
+        size *= 2;
+    if (UNLIKELY(size > MAX_HEADERS_SIZE))
+        return false;
+
+    new_headers = coro_malloc(request->conn->coro, size);
+    if (UNLIKELY(!new_headers))
+        return false;
+
+    memcpy(new_headers, *headers, used);
+    *headers = new_headers;
+    *p_headers = new_headers + used;
+    *p_headers_end = new_headers + size;
+    return true;
+}
+
 #define RETURN_0_ON_OVERFLOW(len_) \
-    if (UNLIKELY(p_headers + (len_) >= p_headers_end)) return 0
+    if (UNLIKELY(p_headers + (len_) >= p_headers_end)) { \
+        if (!growable || !grow_headers(request, &headers, &p_headers, \
+                                       &p_headers_end, (len_))) \
+            return 0; \
+    }
 
 #define APPEND_STRING_LEN(const_str_,len_) \
     do { \
@@ -252,13 +308,15 @@ lwan_default_response(struct lwan_request *request, enum lwan_http_status status
 #define APPEND_CONSTANT(const_str_) \
     APPEND_STRING_LEN((const_str_), sizeof(const_str_) - 1)
 
-size_t
-lwan_prepare_response_header_full(struct lwan_request *request,
+static size_t
+prepare_response_header(struct lwan_request *request,
     enum lwan_http_status status,
-    char headers[],
+    char **headers_ptr,
     size_t headers_buf_size,
-    const struct lwan_key_value *additional_headers)
+    const struct lwan_key_value *additional_headers,
+    bool growable)
 {
+    char *headers = *headers_ptr;
     char *p_headers;
     char *p_headers_end = headers + headers_buf_size;
     char buffer[INT_TO_STR_BUFFER_SIZE];
@@ -343,9 +401,21 @@ lwan_prepare_response_header_full(struct lwan_request *request,
 
     APPEND_CONSTANT("\r\nServer: lwan\r\n\r\n\0");
 
+    *headers_ptr = headers;
     return (size_t)(p_headers - headers - 1);
 }
 
+size_t
+lwan_prepare_response_header_full(struct lwan_request *request,
+    enum lwan_http_status status,
+    char headers[],
+    size_t headers_buf_size,
+    const struct lwan_key_value *additional_headers)
+{
+    return prepare_response_header(request, status, &headers,
+        headers_buf_size, additional_headers, false);
+}
+
 #undef APPEND_CHAR
 #undef APPEND_CHAR_NOCHECK
 #undef APPEND_CONSTANT
@@ -354,33 +424,207 @@ lwan_prepare_response_header_full(struct lwan_request *request,
 #undef APPEND_UINT
 #undef RETURN_0_ON_OVERFLOW
 
+/* Most responses differ only in their Content-Length, Date and Expires
+ * headers: the rest is kept, per thread, already serialized.  Templates
+ * are split around the Content-Length value; Date and Expires are
+ * patched in place once per second.  */
+#define HEADER_TEMPLATE_CACHE_SIZE 16
+
+struct header_template {
+    const char *mime_type;      /* NULL if this slot is empty */
+    unsigned int key;
+    time_t date;
+    unsigned short prefix_len, suffix_len;
+    unsigned short mime_type_offset, mime_type_len;
+    unsigned short date_offset, expires_offset;
+    char prefix[64];
+    char suffix[DEFAULT_HEADERS_SIZE];
+};
+
+static __thread struct header_template header_templates[HEADER_TEMPLATE_CACHE_SIZE];
+
+static ALWAYS_INLINE unsigned int
+header_template_key(const struct lwan_request *request,
+    enum lwan_http_status status)
+{
+    unsigned int key = (unsigned int)status;
+
+    if (request->flags & REQUEST_IS_HTTP_1_0)
+        key |= 1<<16;
+    if (request->flags & REQUEST_ALLOW_CORS)
+        key |= 1<<17;
+    if (request->conn->flags & CONN_KEEP_ALIVE)
+        key |= 1<<18;
+
+    return key;
+}
+
+static struct header_template *
+header_template_slot(const char *mime_type, unsigned int key)
+{
+    uintptr_t hash = ((uintptr_t)mime_type >> 3) ^ key ^ (key >> 16);
+
+    return &header_templates[hash % HEADER_TEMPLATE_CACHE_SIZE];
+}
+
+static ALWAYS_INLINE bool
+header_template_matches(const struct header_template *tpl,
+    const char *mime_type, unsigned int key)
+{
+    /* MIME types are usually constants, but might have been allocated
+     * and freed since the template was built: compare the contents too */
+    return tpl->mime_type == mime_type && tpl->key == key &&
+        !strncmp(tpl->suffix + tpl->mime_type_offset, mime_type, tpl->mime_type_len) &&
+        mime_type[tpl->mime_type_len] == '\0';
+}
+
+static void
+header_template_store(struct header_template *tpl, const char *mime_type,
+    unsigned int key, const char *headers, size_t len)
+{
+    const char *end = headers + len;
+    const char *length, *length_end, *content_type, *date, *expires;
+
+    length = memmem(headers, len, "\r\nContent-Length: ", 18);
+    if (UNLIKELY(!length))
+        return;
+    length += 18;
+    length_end = memchr(length, '\r', (size_t)(end - length));
+    if (UNLIKELY(!length_end))
+        return;
+
+    content_type = memmem(length_end, (size_t)(end - length_end),
+        "\r\nContent-Type: ", 16);
+    date = memmem(length_end, (size_t)(end - length_end), "\r\nDate: ", 8);
+    expires = memmem(length_end, (size_t)(end - length_end), "\r\nExpires: ", 11);
+    if (UNLIKELY(!content_type || !date || !expires))
+        return;
+
+    if (UNLIKELY((size_t)(length - headers) > sizeof(tpl->prefix)))
+        return;
+    if (UNLIKELY((size_t)(end - length_end) > sizeof(tpl->suffix)))
+        return;
+
+    tpl->key = key;
+    tpl->date = 0;
+    tpl->prefix_len = (unsigned short)(length - headers);
+    tpl->suffix_len = (unsigned short)(end - length_end);
+    tpl->mime_type_offset = (unsigned short)(content_type + 16 - length_end);
+    tpl->mime_type_len = (unsigned short)strlen(mime_type);
+    tpl->date_offset = (unsigned short)(date + 8 - length_end);
+    tpl->expires_offset = (unsigned short)(expires + 11 - length_end);
+    memcpy(tpl->prefix, headers, tpl->prefix_len);
+    memcpy(tpl->suffix, length_end, tpl->suffix_len);
+    tpl->mime_type = mime_type;
+}
+
+static size_t
+prepare_cached_response_header(struct lwan_request *request,
+    enum lwan_http_status status,
+    char **headers,
+    size_t headers_buf_size,
+    bool growable)
+{
+    const char *mime_type = request->response.mime_type;
+    struct header_template *tpl;
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    unsigned int key;
+    size_t length, length_len, len;
+    char *length_str, *p;
+
+    /* Custom headers, and anything but a plain Content-Length, are rare
+     * enough to always go through the full builder */
+    if (request->response.headers || !mime_type ||
+            (request->flags & (RESPONSE_CHUNKED_ENCODING | RESPONSE_NO_CONTENT_LENGTH)))
+        return prepare_response_header(request, status, headers,
+            headers_buf_size, request->response.headers, growable);
+
+    key = header_template_key(request, status);
+    tpl = header_template_slot(mime_type, key);
+    if (UNLIKELY(!header_template_matches(tpl, mime_type, key))) {
+        len = prepare_response_header(request, status, headers,
+            headers_buf_size, NULL, growable);
+        if (LIKELY(len))
+            header_template_store(tpl, mime_type, key, *headers, len);
+        return len;
+    }
+
+    if (tpl->date != request->conn->thread->date.last) {
+        tpl->date = request->conn->thread->date.last;
+        memcpy(tpl->suffix + tpl->date_offset, request->conn->thread->date.date, 29);
+        memcpy(tpl->suffix + tpl->expires_offset,
+            request->conn->thread->date.expires, 29);
+    }
+
+    if (request->response.stream.callback)
+        length = request->response.content_length;
+    else
+        length = strbuf_get_length(request->response.buffer);
+    length_str = uint_to_string(length, buffer, &length_len);
+
+    len = tpl->prefix_len + length_len + tpl->suffix_len;
+    if (UNLIKELY(len >= headers_buf_size))
+        return prepare_response_header(request, status, headers,
+            headers_buf_size, NULL, growable);
+
+    p = mempcpy(*headers, tpl->prefix, tpl->prefix_len);
+    p = mempcpy(p, length_str, length_len);
+    p = mempcpy(p, tpl->suffix, tpl->suffix_len);
+    *p = '\0';
+
+    return len;
+}
+
 ALWAYS_INLINE size_t
 lwan_prepare_response_header(struct lwan_request *request,
     enum lwan_http_status status,
     char headers[],
     size_t headers_buf_size)
 {
-    return lwan_prepare_response_header_full(request,
-        status, headers, headers_buf_size, request->response.headers);
+    return prepare_cached_response_header(request, status, &headers,
+        headers_buf_size, false);
+}
+
+size_t
+lwan_prepare_response_header_growable(struct lwan_request *request,
+    enum lwan_http_status status,
+    char **headers,
+    size_t headers_buf_size)
+{
+    return prepare_cached_response_header(request, status, headers,
+        headers_buf_size, true);
+}
+
+/* Chunks and events are collected in the connection's output batch, which
+ * is sent when it fills up, when the response ends, before the coroutine
+ * yields to wait for something, or when lwan_response_flush() is called.  */
+static void
+send_buffered(struct lwan_request *request, struct iovec *iov, int iov_count)
+{
+    if (!lwan_response_batch_add(request, iov, iov_count))
+        lwan_writev(request, iov, iov_count);
 }
 
 bool
 lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status status)
 {
-    char buffer[DEFAULT_BUFFER_SIZE];
+    char headers[DEFAULT_HEADERS_SIZE];
+    char *buffer = headers;
     size_t buffer_len;
 
     if (request->flags & RESPONSE_SENT_HEADERS)
         return false;
 
     request->flags |= RESPONSE_CHUNKED_ENCODING;
-    buffer_len = lwan_prepare_response_header(request, status,
-                                                buffer, DEFAULT_BUFFER_SIZE);
+    buffer_len = lwan_prepare_response_header_growable(request, status,
+                                                &buffer, sizeof(headers));
     if (UNLIKELY(!buffer_len))
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    send_buffered(request, (struct iovec[]) {
+        { .iov_base = buffer, .iov_len = buffer_len },
+    }, 1);
 
     return true;
 }
@@ -396,39 +640,43 @@ lwan_response_send_chunk(struct lwan_request *request)
     size_t buffer_len = strbuf_get_length(request->response.buffer);
     if (UNLIKELY(!buffer_len)) {
         static const char last_chunk[] = "0\r\n\r\n";
-        lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
+        send_buffered(request, (struct iovec[]) {
+            { .iov_base = (void *)last_chunk, .iov_len = sizeof(last_chunk) - 1 },
+        }, 1);
         return;
     }
 
-    char chunk_size[3 * sizeof(size_t) + 2];
-    int converted_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", buffer_len);
-    if (UNLIKELY(converted_len < 0 || (size_t)converted_len >= sizeof(chunk_size)))
-        goto abort_coro;
-    size_t chunk_size_len = (size_t)converted_len;
+    char chunk_size[2 * sizeof(size_t) + 2];
+    char *p = chunk_size + sizeof(chunk_size);
+    size_t len = buffer_len;
+
+    *--p = '\n';
+    *--p = '\r';
+    do {
+        *--p = "0123456789abcdef"[len & 0xf];
+        len >>= 4;
+    } while (len);
 
     struct iovec chunk_vec[] = {
-        { .iov_base = chunk_size, .iov_len = chunk_size_len },
+        { .iov_base = p, .iov_len = (size_t)(chunk_size + sizeof(chunk_size) - p) },
         { .iov_base = strbuf_get_buffer(request->response.buffer), .iov_len = buffer_len },
         { .iov_base = "\r\n", .iov_len = 2 }
     };
 
-    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    send_buffered(request, chunk_vec, N_ELEMENTS(chunk_vec));
 
-    if (LIKELY(strbuf_reset(request->response.buffer))) {
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-        return;
+    if (UNLIKELY(!strbuf_reset(request->response.buffer))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
     }
-
-abort_coro:
-    coro_yield(request->conn->coro, CONN_CORO_ABORT);
-    __builtin_unreachable();
 }
 
 bool
 lwan_response_set_event_stream(struct lwan_request *request,
                                enum lwan_http_status status)
 {
-    char buffer[DEFAULT_BUFFER_SIZE];
+    char headers[DEFAULT_HEADERS_SIZE];
+    char *buffer = headers;
     size_t buffer_len;
 
     if (request->flags & RESPONSE_SENT_HEADERS)
@@ -436,13 +684,15 @@ lwan_response_set_event_stream(struct lwan_request *request,
 
     request->response.mime_type = "text/event-stream";
     request->flags |= RESPONSE_NO_CONTENT_LENGTH;
-    buffer_len = lwan_prepare_response_header(request, status,
-                                                buffer, DEFAULT_BUFFER_SIZE);
+    buffer_len = lwan_prepare_response_header_growable(request, status,
+                                                &buffer, sizeof(headers));
     if (UNLIKELY(!buffer_len))
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    send_buffered(request, (struct iovec[]) {
+        { .iov_base = buffer, .iov_len = buffer_len },
+    }, 1);
 
     return true;
 }
@@ -488,12 +738,16 @@ lwan_response_send_event(struct lwan_request *request, const char *event)
     vec[last].iov_len = 4;
     last++;
 
-    lwan_writev(request, vec, last);
+    send_buffered(request, vec, last);
 
     if (UNLIKELY(!strbuf_reset(request->response.buffer))) {
         coro_yield(request->conn->coro, CONN_CORO_ABORT);
         __builtin_unreachable();
     }
+}
 
-    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+void
+lwan_response_flush(struct lwan_request *request)
+{
+    lwan_response_batch_flush(request);
 }
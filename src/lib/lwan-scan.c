@@ -0,0 +1,214 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#if defined(__SSE2__) || defined(HAVE_AVX2_TARGET)
+#include <immintrin.h>
+#endif
+
+#include "lwan.h"
+#include "lwan-scan.h"
+
+static ALWAYS_INLINE bool
+found_newline(struct lwan_line_scan *scan, const char *buffer, size_t offset)
+{
+    if (LIKELY(scan->n_lines < LWAN_SCAN_MAX_LINES))
+        scan->lines[scan->n_lines++] = (uint32_t)offset;
+
+    if (offset >= 3 && string_as_int32(buffer + offset - 3) ==
+                MULTICHAR_CONSTANT('\r', '\n', '\r', '\n')) {
+        scan->terminator = scan->scanned = (uint32_t)offset + 1;
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+scan_lines_tail(struct lwan_line_scan *scan, const char *buffer,
+    size_t offset, size_t len)
+{
+    while (offset < len) {
+        const char *newline = memchr(buffer + offset, '\n', len - offset);
+
+        if (!newline)
+            break;
+
+        offset = (size_t)(newline - buffer);
+        if (found_newline(scan, buffer, offset))
+            return true;
+        offset++;
+    }
+
+    scan->scanned = (uint32_t)len;
+    return false;
+}
+
+#if defined(__SSE2__)
+static bool
+scan_lines_sse2(struct lwan_line_scan *scan, const char *buffer, size_t len)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t offset;
+
+    for (offset = scan->scanned; offset + 16 <= len; offset += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + offset));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        for (; mask; mask &= mask - 1) {
+            if (found_newline(scan, buffer, offset + (size_t)__builtin_ctz(mask)))
+                return true;
+        }
+    }
+
+    return scan_lines_tail(scan, buffer, offset, len);
+}
+
+static ALWAYS_INLINE unsigned
+url_special_mask_sse2(const char *p)
+{
+    const __m128i chunk = _mm_load_si128((const __m128i *)p);
+    const __m128i special = _mm_or_si128(
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('%')),
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')));
+
+    return (unsigned)_mm_movemask_epi8(
+        _mm_or_si128(special, _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+}
+
+/* Aligned loads never cross a page boundary, so reading past the
+ * terminating NUL (or before the start of the string) is harmless. */
+__attribute__((no_sanitize_address))
+static char *
+url_special_sse2(char *str)
+{
+    const size_t misalignment = (uintptr_t)str & 15;
+    const char *p = str - misalignment;
+    unsigned mask = url_special_mask_sse2(p) & (0xffffu << misalignment);
+
+    while (!mask) {
+        p += 16;
+        mask = url_special_mask_sse2(p);
+    }
+
+    return (char *)p + __builtin_ctz(mask);
+}
+#endif
+
+#if defined(HAVE_AVX2_TARGET)
+__attribute__((target("avx2")))
+static bool
+scan_lines_avx2(struct lwan_line_scan *scan, const char *buffer, size_t len)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t offset;
+
+    for (offset = scan->scanned; offset + 32 <= len; offset += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buffer + offset));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        for (; mask; mask &= mask - 1) {
+            if (found_newline(scan, buffer, offset + (size_t)__builtin_ctz(mask)))
+                return true;
+        }
+    }
+
+    return scan_lines_tail(scan, buffer, offset, len);
+}
+
+__attribute__((target("avx2")))
+static ALWAYS_INLINE unsigned
+url_special_mask_avx2(const char *p)
+{
+    const __m256i chunk = _mm256_load_si256((const __m256i *)p);
+    const __m256i special = _mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('%')),
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('+')));
+
+    return (unsigned)_mm256_movemask_epi8(
+        _mm256_or_si256(special, _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static char *
+url_special_avx2(char *str)
+{
+    const size_t misalignment = (uintptr_t)str & 31;
+    const char *p = str - misalignment;
+    unsigned mask = url_special_mask_avx2(p) & (0xffffffffu << misalignment);
+
+    while (!mask) {
+        p += 32;
+        mask = url_special_mask_avx2(p);
+    }
+
+    return (char *)p + __builtin_ctz(mask);
+}
+#endif
+
+#if !defined(__SSE2__)
+static bool
+scan_lines_generic(struct lwan_line_scan *scan, const char *buffer, size_t len)
+{
+    return scan_lines_tail(scan, buffer, scan->scanned, len);
+}
+
+static char *
+url_special_generic(char *str)
+{
+    return str + strcspn(str, "%+");
+}
+
+static bool (*scan_lines)(struct lwan_line_scan *scan, const char *buffer,
+    size_t len) = scan_lines_generic;
+static char *(*url_special)(char *str) = url_special_generic;
+#else
+static bool (*scan_lines)(struct lwan_line_scan *scan, const char *buffer,
+    size_t len) = scan_lines_sse2;
+static char *(*url_special)(char *str) = url_special_sse2;
+#endif
+
+__attribute__((constructor))
+static void initialize_scanners(void)
+{
+#if defined(HAVE_BUILTIN_CPU_INIT) && defined(HAVE_AVX2_TARGET)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_lines = scan_lines_avx2;
+        url_special = url_special_avx2;
+    }
+#endif
+}
+
+bool
+lwan_scan_lines(struct lwan_line_scan *scan, const char *buffer, size_t len)
+{
+    if (scan->terminator)
+        return true;
+
+    return scan_lines(scan, buffer, len);
+}
+
+char *
+lwan_scan_url_special(char *str)
+{
+    return url_special(str);
+}
@@ -0,0 +1,45 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LWAN_SCAN_MAX_LINES 64
+
+/* Line ends of a request header, found incrementally as it's read.  Only
+ * the first LWAN_SCAN_MAX_LINES are recorded; the search for the end of
+ * the header continues after that.  */
+struct lwan_line_scan {
+    uint32_t scanned;       /* Bytes already looked at */
+    uint32_t terminator;    /* Offset past CRLFCRLF; 0 if not found yet */
+    uint32_t n_lines;
+    uint32_t lines[LWAN_SCAN_MAX_LINES];    /* Offsets of each '\n' */
+};
+
+/* Scans buffer[scan->scanned..len); returns true once the end of the
+ * header has been found. */
+bool lwan_scan_lines(struct lwan_line_scan *scan, const char *buffer,
+    size_t len);
+
+/* Returns a pointer to the first '%' or '+' in a NUL-terminated string,
+ * or to its terminating NUL if there are none. */
+char *lwan_scan_url_special(char *str);
@@ -142,11 +142,14 @@ parse_listener(char *listener, char **node, char **port)
 }
 
 static int
-listen_addrinfo(int fd, const struct addrinfo *addr)
+listen_addrinfo(int fd, const struct addrinfo *addr, bool print_address)
 {
     if (listen(fd, get_backlog_size()) < 0)
         lwan_status_critical_perror("listen");
 
+    if (!print_address)
+        return fd;
+
     char host_buf[NI_MAXHOST], serv_buf[NI_MAXSERV];
     int ret = getnameinfo(addr->ai_addr, addr->ai_addrlen, host_buf, sizeof(host_buf),
                       serv_buf, sizeof(serv_buf), NI_NUMERICHOST | NI_NUMERICSERV);
@@ -178,24 +181,39 @@ listen_addrinfo(int fd, const struct addrinfo *addr)
 #define SO_REUSEPORT 15
 #endif
 
+enum listener_flags {
+    LISTENER_REUSE_PORT = 1<<0,
+    LISTENER_MUST_REUSE_PORT = 1<<1,
+    LISTENER_NONBLOCK = 1<<2,
+    LISTENER_QUIET = 1<<3,
+};
+
 static int
-bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
+bind_and_listen_addrinfos(struct addrinfo *addrs, enum listener_flags flags)
 {
     const struct addrinfo *addr;
+    int type_flags = SOCK_CLOEXEC;
+
+    if (flags & LISTENER_NONBLOCK)
+        type_flags |= SOCK_NONBLOCK;
 
     /* Try each address until we bind one successfully. */
     for (addr = addrs; addr; addr = addr->ai_next) {
         int fd = socket(addr->ai_family,
-            addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+            addr->ai_socktype | type_flags, addr->ai_protocol);
         if (fd < 0)
             continue;
 
         SET_SOCKET_OPTION(SOL_SOCKET, SO_REUSEADDR, (int[]){ 1 }, sizeof(int));
-        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_REUSEPORT,
-                                                (int[]){ reuse_port }, sizeof(int));
+        if (flags & LISTENER_MUST_REUSE_PORT) {
+            SET_SOCKET_OPTION(SOL_SOCKET, SO_REUSEPORT, (int[]){ 1 }, sizeof(int));
+        } else {
+            SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_REUSEPORT,
+                (int[]){ !!(flags & LISTENER_REUSE_PORT) }, sizeof(int));
+        }
 
         if (!bind(fd, addr->ai_addr, addr->ai_addrlen))
-            return listen_addrinfo(fd, addr);
+            return listen_addrinfo(fd, addr, !(flags & LISTENER_QUIET));
 
         close(fd);
     }
@@ -204,7 +222,7 @@ bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
 }
 
 static int
-setup_socket_normally(struct lwan *l)
+setup_socket_normally(struct lwan *l, enum listener_flags flags)
 {
     char *node, *port;
     char *listener = strdupa(l->config.listener);
@@ -223,7 +241,7 @@ setup_socket_normally(struct lwan *l)
     if (ret)
         lwan_status_critical("getaddrinfo: %s", gai_strerror(ret));
 
-    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port);
+    int fd = bind_and_listen_addrinfos(addrs, flags);
     freeaddrinfo(addrs);
     return fd;
 }
@@ -232,6 +250,63 @@ setup_socket_normally(struct lwan *l)
 #define TCP_FASTOPEN 23
 #endif
 
+static void
+set_listener_options(const struct lwan *l, int fd)
+{
+    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
+        (&(struct linger){ .l_onoff = 1, .l_linger = 1 }), sizeof(struct linger));
+
+#ifdef __linux__
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
+                                            (int[]){ 5 }, sizeof(int));
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK,
+                                            (int[]){ 0 }, sizeof(int));
+
+    if (l->config.defer_accept) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_DEFER_ACCEPT,
+                        (int[]){ l->config.read_header_timeout }, sizeof(int));
+    }
+
+    /* Accepted sockets inherit these from the listening socket */
+    if (l->config.busy_poll_budget) {
+#ifdef SO_BUSY_POLL
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_BUSY_POLL,
+                        (int[]){ (int)l->config.busy_poll_budget }, sizeof(int));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                                            (int[]){ 1 }, sizeof(int));
+#endif
+    }
+#else
+    (void)l;
+#endif
+}
+
+static void
+setup_per_thread_sockets(struct lwan *l)
+{
+    /* Each I/O thread gets its own listening socket, all of them bound to
+     * the same address with SO_REUSEPORT, so that the kernel distributes
+     * incoming connections between them and they're accepted directly by
+     * the threads (without going through lwan_main_loop()).  */
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        enum listener_flags flags = LISTENER_MUST_REUSE_PORT | LISTENER_NONBLOCK;
+        int fd;
+
+        if (i > 0)
+            flags |= LISTENER_QUIET;
+
+        fd = setup_socket_normally(l, flags);
+        set_listener_options(l, fd);
+
+        lwan_thread_add_listener(&l->thread.threads[i], fd);
+    }
+
+    lwan_status_info("Using %d listening sockets (one per thread)",
+        l->thread.count);
+}
+
 void
 lwan_socket_init(struct lwan *l)
 {
@@ -244,19 +319,22 @@ lwan_socket_init(struct lwan *l)
         lwan_status_critical("Too many file descriptors received");
     } else if (n == 1) {
         fd = setup_socket_from_systemd();
+
+        if (l->config.per_thread_listeners) {
+            lwan_status_warning("Socket activated by systemd: not using "
+                "per-thread listeners");
+            l->config.per_thread_listeners = false;
+        }
+    } else if (l->config.per_thread_listeners) {
+        setup_per_thread_sockets(l);
+        l->main_socket = -1;
+        return;
     } else {
-        fd = setup_socket_normally(l);
+        fd = setup_socket_normally(l,
+            l->config.reuse_port ? LISTENER_REUSE_PORT : 0);
     }
 
-    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
-        (&(struct linger){ .l_onoff = 1, .l_linger = 1 }), sizeof(struct linger));
-
-#ifdef __linux__
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
-                                            (int[]){ 5 }, sizeof(int));
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK,
-                                            (int[]){ 0 }, sizeof(int));
-#endif
+    set_listener_options(l, fd);
 
     l->main_socket = fd;
 }
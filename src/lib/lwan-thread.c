@@ -19,114 +19,282 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
-#include "lwan-private.h"
+#if defined(HAS_EVENTFD)
+#include <sys/eventfd.h>
+#endif
 
-struct death_queue_t {
+#include "lwan-private.h"
+#include "queue.h"
+
+#if defined(HAVE_IO_URING)
+#include "lwan-uring.h"
+
+/* Completions for requests that don't need to be handled (e.g. cancellation
+ * requests) carry this value; it can't be mistaken for a pointer to a
+ * connection (even with LWAN_URING_IO set) or a thread.  The eventfd poll
+ * request has a NULL pointer, just like in the epoll case.  */
+#define URING_IGNORE ((uint64_t)1)
+#endif
+
+/* Connections are kept in a hierarchical timing wheel: three levels of 64
+ * slots each, with 125ms ticks in the first level.  Slot heads are nodes
+ * just like connections, and are referred to by negative indices in the
+ * prev/next fields, so struct lwan_connection doesn't grow. */
+#define TIMEOUT_WHEEL_TICK_MS 125
+#define TIMEOUT_WHEEL_LEVELS 3
+#define TIMEOUT_WHEEL_SLOT_BITS 6
+#define TIMEOUT_WHEEL_SLOTS (1u << TIMEOUT_WHEEL_SLOT_BITS)
+#define TIMEOUT_WHEEL_SLOT_MASK (TIMEOUT_WHEEL_SLOTS - 1)
+#define TIMEOUT_WHEEL_MAX_TICKS (1u << (TIMEOUT_WHEEL_SLOT_BITS * TIMEOUT_WHEEL_LEVELS))
+
+struct timeout_wheel {
     const struct lwan *lwan;
     struct lwan_connection *conns;
-    struct lwan_connection head;
-    unsigned time;
-    unsigned short keep_alive_timeout;
-};
-
-static const uint32_t events_by_write_flag[] = {
-    EPOLLOUT | EPOLLRDHUP | EPOLLERR,
-    EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLET
+    struct timespec epoch;
+    uint64_t elapsed_ms;
+    unsigned now;       /* Last tick that has been processed */
+    unsigned current;   /* Tick when the current batch of events arrived */
+    unsigned timeouts[4]; /* In ticks, indexed by connection phase */
+    uint64_t nonempty[TIMEOUT_WHEEL_LEVELS];
+    struct lwan_connection slots[TIMEOUT_WHEEL_LEVELS * TIMEOUT_WHEEL_SLOTS];
 };
 
-static inline int death_queue_node_to_idx(struct death_queue_t *dq,
-    struct lwan_connection *conn)
+static inline struct lwan_connection *
+timeout_wheel_idx_to_node(struct timeout_wheel *wheel, int idx)
 {
-    return (conn == &dq->head) ? -1 : (int)(ptrdiff_t)(conn - dq->conns);
+    return (idx < 0) ? &wheel->slots[-1 - idx] : &wheel->conns[idx];
 }
 
-static inline struct lwan_connection *death_queue_idx_to_node(struct death_queue_t *dq,
-    int idx)
+static void
+timeout_wheel_insert(struct timeout_wheel *wheel, struct lwan_connection *conn)
 {
-    return (idx < 0) ? &dq->head : &dq->conns[idx];
+    const unsigned delta = conn->time_to_die - wheel->now;
+    unsigned level, slot;
+
+    if (delta < TIMEOUT_WHEEL_SLOTS) {
+        level = 0;
+        slot = conn->time_to_die & TIMEOUT_WHEEL_SLOT_MASK;
+    } else if (delta < TIMEOUT_WHEEL_SLOTS * TIMEOUT_WHEEL_SLOTS) {
+        level = 1;
+        slot = (conn->time_to_die >> TIMEOUT_WHEEL_SLOT_BITS) & TIMEOUT_WHEEL_SLOT_MASK;
+    } else {
+        level = 2;
+        slot = (conn->time_to_die >> (2 * TIMEOUT_WHEEL_SLOT_BITS)) & TIMEOUT_WHEEL_SLOT_MASK;
+    }
+
+    const int head_idx = -1 - (int)(level * TIMEOUT_WHEEL_SLOTS + slot);
+    struct lwan_connection *head = timeout_wheel_idx_to_node(wheel, head_idx);
+    const int idx = (int)(ptrdiff_t)(conn - wheel->conns);
+
+    conn->next = head_idx;
+    conn->prev = head->prev;
+    timeout_wheel_idx_to_node(wheel, head->prev)->next = idx;
+    head->prev = idx;
+
+    wheel->nonempty[level] |= 1ull << slot;
 }
 
-static void death_queue_insert(struct death_queue_t *dq,
-    struct lwan_connection *new_node)
+static void
+timeout_wheel_remove(struct timeout_wheel *wheel, struct lwan_connection *conn)
 {
-    new_node->next = -1;
-    new_node->prev = dq->head.prev;
-    struct lwan_connection *prev = death_queue_idx_to_node(dq, dq->head.prev);
-    dq->head.prev = prev->next = death_queue_node_to_idx(dq, new_node);
+    struct lwan_connection *prev = timeout_wheel_idx_to_node(wheel, conn->prev);
+    struct lwan_connection *next = timeout_wheel_idx_to_node(wheel, conn->next);
+
+    next->prev = conn->prev;
+    prev->next = conn->next;
+
+    /* Both neighbors are the same slot head: that slot is now empty. */
+    if (conn->prev < 0 && conn->prev == conn->next) {
+        const unsigned slot = (unsigned)(-1 - conn->prev);
+
+        wheel->nonempty[slot / TIMEOUT_WHEEL_SLOTS] &=
+            ~(1ull << (slot % TIMEOUT_WHEEL_SLOTS));
+    }
 }
 
-static void death_queue_remove(struct death_queue_t *dq,
-    struct lwan_connection *node)
+static void
+timeout_wheel_schedule(struct timeout_wheel *wheel, struct lwan_connection *conn)
 {
-    struct lwan_connection *prev = death_queue_idx_to_node(dq, node->prev);
-    struct lwan_connection *next = death_queue_idx_to_node(dq, node->next);
-    next->prev = node->prev;
-    prev->next = node->next;
+    const enum lwan_connection_flags phase = conn->flags & CONN_PHASE_MASK;
+    unsigned timeout = wheel->timeouts[phase / CONN_PHASE_HEADER];
+
+    /* Idle connections that can't be resumed are reaped right away. */
+    if (phase == CONN_PHASE_KEEP_ALIVE &&
+            !(conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO)))
+        timeout = 0;
 
-    /* FIXME: This shouldn't be required; there may be a bug somewhere when
-     * a few million requests are attended to.  */
-    node->next = node->prev = -1;
+    conn->time_to_die = wheel->current + timeout;
+
+    if (UNLIKELY(conn->time_to_die - wheel->now >= TIMEOUT_WHEEL_MAX_TICKS))
+        conn->time_to_die = wheel->now + TIMEOUT_WHEEL_MAX_TICKS - 1;
+    else if (conn->time_to_die == wheel->now)
+        conn->time_to_die++; /* This slot has already been expired */
 }
 
-static bool death_queue_empty(struct death_queue_t *dq)
+static void
+timeout_wheel_touch(struct timeout_wheel *wheel, struct lwan_connection *conn)
 {
-    return dq->head.next < 0;
+    if (UNLIKELY(!(conn->flags & CONN_IS_ALIVE)))
+        return;
+
+    /* Reading the header or the body has a deadline for the whole phase,
+     * so only move these connections when they start a new phase.  Writes
+     * flag a phase change whenever they make progress.  */
+    if (!(conn->flags & CONN_PHASE_CHANGED)) {
+        switch (conn->flags & CONN_PHASE_MASK) {
+        case CONN_PHASE_HEADER:
+        case CONN_PHASE_BODY:
+        case CONN_PHASE_WRITE:
+            return;
+        default:
+            break;
+        }
+    }
+
+    conn->flags &= ~CONN_PHASE_CHANGED;
+
+    timeout_wheel_remove(wheel, conn);
+    timeout_wheel_schedule(wheel, conn);
+    timeout_wheel_insert(wheel, conn);
 }
 
-static void death_queue_move_to_last(struct death_queue_t *dq,
-    struct lwan_connection *conn)
+static void
+timeout_wheel_update_clock(struct timeout_wheel *wheel)
 {
-    /*
-     * If the connection isn't keep alive, it might have a coroutine that
-     * should be resumed.  If that's the case, schedule for this request to
-     * die according to the keep alive timeout.
-     *
-     * If it's not a keep alive connection, or the coroutine shouldn't be
-     * resumed -- then just mark it to be reaped right away.
-     */
-    conn->time_to_die = dq->time;
-    if (conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO))
-        conn->time_to_die += dq->keep_alive_timeout;
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        lwan_status_critical_perror("clock_gettime");
 
-    death_queue_remove(dq, conn);
-    death_queue_insert(dq, conn);
+    wheel->elapsed_ms = (uint64_t)(now.tv_sec - wheel->epoch.tv_sec) * 1000 +
+        (uint64_t)((now.tv_nsec - wheel->epoch.tv_nsec) / 1000000);
+    wheel->current = (unsigned)(wheel->elapsed_ms / TIMEOUT_WHEEL_TICK_MS);
 }
 
 static void
-death_queue_init(struct death_queue_t *dq, const struct lwan *lwan)
+timeout_wheel_init(struct timeout_wheel *wheel, const struct lwan *lwan)
 {
-    dq->lwan = lwan;
-    dq->conns = lwan->conns;
-    dq->time = 0;
-    dq->keep_alive_timeout = lwan->config.keep_alive_timeout;
-    dq->head.next = dq->head.prev = -1;
+    const unsigned ticks_per_sec = 1000 / TIMEOUT_WHEEL_TICK_MS;
+
+    wheel->lwan = lwan;
+    wheel->conns = lwan->conns;
+
+    wheel->timeouts[CONN_PHASE_KEEP_ALIVE / CONN_PHASE_HEADER] =
+        lwan->config.keep_alive_timeout * ticks_per_sec;
+    wheel->timeouts[CONN_PHASE_HEADER / CONN_PHASE_HEADER] =
+        lwan->config.read_header_timeout * ticks_per_sec;
+    wheel->timeouts[CONN_PHASE_BODY / CONN_PHASE_HEADER] =
+        lwan->config.read_body_timeout * ticks_per_sec;
+    wheel->timeouts[CONN_PHASE_WRITE / CONN_PHASE_HEADER] =
+        lwan->config.write_timeout * ticks_per_sec;
+
+    for (size_t i = 0; i < N_ELEMENTS(wheel->slots); i++)
+        wheel->slots[i].next = wheel->slots[i].prev = -1 - (int)i;
+    for (size_t i = 0; i < TIMEOUT_WHEEL_LEVELS; i++)
+        wheel->nonempty[i] = 0;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &wheel->epoch) < 0))
+        lwan_status_critical_perror("clock_gettime");
+    wheel->elapsed_ms = 0;
+    wheel->now = wheel->current = 0;
+}
+
+static bool
+timeout_wheel_next_tick(struct timeout_wheel *wheel, unsigned *tick)
+{
+    bool found = false;
+
+    if (wheel->nonempty[0]) {
+        const unsigned base = wheel->now + 1;
+        const unsigned rotate = base & TIMEOUT_WHEEL_SLOT_MASK;
+        uint64_t bitmap = wheel->nonempty[0];
+
+        if (rotate)
+            bitmap = (bitmap >> rotate) | (bitmap << (TIMEOUT_WHEEL_SLOTS - rotate));
+
+        *tick = base + (unsigned)__builtin_ctzll(bitmap);
+        found = true;
+    }
+
+    if (wheel->nonempty[1] || wheel->nonempty[2]) {
+        /* Upper levels are cascaded at every first-level wrap around */
+        const unsigned boundary = (wheel->now | TIMEOUT_WHEEL_SLOT_MASK) + 1;
+
+        if (!found || boundary < *tick)
+            *tick = boundary;
+        found = true;
+    }
+
+    return found;
 }
 
 static ALWAYS_INLINE int
-death_queue_epoll_timeout(struct death_queue_t *dq)
+timeout_wheel_epoll_timeout(struct timeout_wheel *wheel)
 {
-    return death_queue_empty(dq) ? -1 : 1000;
+    unsigned tick;
+
+    if (!timeout_wheel_next_tick(wheel, &tick))
+        return -1;
+
+    const uint64_t deadline_ms = (uint64_t)tick * TIMEOUT_WHEEL_TICK_MS;
+    if (deadline_ms <= wheel->elapsed_ms)
+        return 0;
+    return (int)(deadline_ms - wheel->elapsed_ms);
 }
 
 static ALWAYS_INLINE void
-destroy_coro(struct death_queue_t *dq, struct lwan_connection *conn)
+destroy_coro(struct timeout_wheel *wheel, struct lwan_connection *conn)
 {
-    death_queue_remove(dq, conn);
+    timeout_wheel_remove(wheel, conn);
+
+#if defined(HAVE_IO_URING)
+    /* The file descriptor can't be closed (and reused by another
+     * connection) while a request for it is in flight, and neither can the
+     * coroutine be freed while the kernel might still be using its stack
+     * or buffers released by its deferred callbacks: the request is
+     * cancelled, and these are released once it completes.  */
+    if (conn->flags & (CONN_POLL_ARMED | CONN_IO_PENDING)) {
+        if (conn->flags & CONN_IS_ALIVE) {
+            conn->flags &= ~CONN_IS_ALIVE;
+            ATOMIC_DEC(conn->thread->stats.live_connections);
+
+            uint64_t target = (uint64_t)(uintptr_t)conn;
+            if (conn->flags & CONN_IO_PENDING)
+                target |= LWAN_URING_IO;
+            lwan_uring_prep_cancel(conn->thread->uring, target, URING_IGNORE);
+        }
+
+        if (conn->coro && !(conn->flags & CONN_IO_PENDING)) {
+            coro_free(conn->coro);
+            conn->coro = NULL;
+        }
+        return;
+    }
+#endif
+
     if (LIKELY(conn->coro)) {
         coro_free(conn->coro);
         conn->coro = NULL;
     }
     if (conn->flags & CONN_IS_ALIVE) {
         conn->flags &= ~CONN_IS_ALIVE;
-        close(lwan_connection_get_fd(dq->lwan, conn));
+        ATOMIC_DEC(conn->thread->stats.live_connections);
+
+        close(lwan_connection_get_fd(wheel->lwan, conn));
     }
 }
 
@@ -148,10 +316,8 @@ process_request_coro(struct coro *coro, void *data)
     struct lwan *lwan = conn->thread->lwan;
     int fd = lwan_connection_get_fd(lwan, conn);
     char request_buffer[DEFAULT_BUFFER_SIZE];
-    struct lwan_value buffer = {
-        .value = request_buffer,
-        .len = 0
-    };
+    struct lwan_request_buffer buffer;
+    struct lwan_response_batch batch = { .n_iov = 0 };
     char *next_request = NULL;
     enum lwan_request_flags flags = 0;
     struct lwan_proxy proxy;
@@ -162,6 +328,10 @@ process_request_coro(struct coro *coro, void *data)
     }
     coro_defer(coro, CORO_DEFER(strbuf_free), &strbuf);
 
+    lwan_request_buffer_init(&buffer, request_buffer);
+    coro_defer(coro, CORO_DEFER(lwan_request_buffer_release), &buffer);
+    coro_defer(coro, CORO_DEFER(lwan_response_batch_free), &batch);
+
     if (lwan->config.proxy_protocol)
         flags |= REQUEST_ALLOW_PROXY_REQS;
     if (lwan->config.allow_cors)
@@ -175,7 +345,8 @@ process_request_coro(struct coro *coro, void *data)
                 .buffer = &strbuf
             },
             .flags = flags,
-            .proxy = &proxy
+            .proxy = &proxy,
+            .batch = &batch
         };
 
         assert(conn->flags & CONN_IS_ALIVE);
@@ -184,7 +355,43 @@ process_request_coro(struct coro *coro, void *data)
         next_request = lwan_process_request(lwan, &request, &buffer, next_request);
         coro_deferred_run(coro, generation);
 
-        coro_yield(coro, CONN_CORO_MAY_RESUME);
+        lwan_connection_set_phase(conn, CONN_PHASE_KEEP_ALIVE);
+
+        if (!next_request || next_request >= buffer.value + buffer.len) {
+            /* Larger buffers are only kept while they hold requests */
+            lwan_request_buffer_release(&buffer);
+            next_request = NULL;
+        }
+
+        /* Responses to pipelined requests are being collected: handle the
+         * next one right away instead of going through the event loop.
+         * The batch is sent (and this coroutine yields) once it's full.  */
+        if (!next_request || !batch.n_iov) {
+            lwan_response_batch_flush(&request);
+
+            /* Buffers sent with MSG_ZEROCOPY are released by this coroutine,
+             * so it can't go away before the kernel is done with them */
+            if (!next_request || !(conn->flags & CONN_KEEP_ALIVE)) {
+                lwan_zerocopy_wait(&request);
+                lwan_connection_set_phase(conn, CONN_PHASE_KEEP_ALIVE);
+            }
+
+            /* Nothing left to process and nothing to read: give the stack
+             * back while the connection is idle.  (Not done with the PROXY
+             * protocol, as a new coroutine would accept another PROXY
+             * header.) */
+            if (!lwan->config.proxy_protocol && !next_request) {
+                char c;
+
+                if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+                    conn->flags &= ~CONN_READABLE;
+                    coro_yield(coro, CONN_CORO_HIBERNATE);
+                    __builtin_unreachable();
+                }
+            }
+
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+        }
 
         if (UNLIKELY(!strbuf_reset(&strbuf))) {
             coro_yield(coro, CONN_CORO_ABORT);
@@ -195,74 +402,156 @@ process_request_coro(struct coro *coro, void *data)
     }
 }
 
-static ALWAYS_INLINE void
-resume_coro_if_needed(struct death_queue_t *dq, struct lwan_connection *conn,
-    int epoll_fd)
+/* Returns false if the connection has been destroyed.  `value` is what
+ * coro_yield() returns to the coroutine. */
+static ALWAYS_INLINE bool
+resume_coro(struct timeout_wheel *wheel, struct lwan_connection *conn,
+    struct coro_switcher *switcher, int value)
 {
-    assert(conn->coro);
-
-    if (!(conn->flags & CONN_SHOULD_RESUME_CORO))
-        return;
+    /* Coroutines are only created once there's something to read */
+    if (!conn->coro) {
+        conn->coro = coro_new(switcher, process_request_coro, conn);
+        if (UNLIKELY(!conn->coro)) {
+            lwan_status_error("Could not create coroutine");
+            destroy_coro(wheel, conn);
+            return false;
+        }
+    }
 
-    enum lwan_connection_coro_yield yield_result = coro_resume(conn->coro);
+    enum lwan_connection_coro_yield yield_result =
+        coro_resume_value(conn->coro, value);
     /* CONN_CORO_ABORT is -1, but comparing with 0 is cheaper */
     if (yield_result < CONN_CORO_MAY_RESUME) {
-        destroy_coro(dq, conn);
-        return;
+        destroy_coro(wheel, conn);
+        return false;
     }
 
-    bool write_events;
-    if (conn->flags & CONN_MUST_READ) {
-        write_events = true;
-    } else {
-        bool should_resume_coro = (yield_result == CONN_CORO_MAY_RESUME);
+    if (yield_result == CONN_CORO_HIBERNATE) {
+        coro_free(conn->coro);
+        conn->coro = NULL;
+        conn->flags |= CONN_SHOULD_RESUME_CORO | CONN_MUST_READ;
+        return true;
+    }
 
-        if (should_resume_coro)
+    if (!(conn->flags & CONN_MUST_READ)) {
+        if (yield_result == CONN_CORO_MAY_RESUME)
             conn->flags |= CONN_SHOULD_RESUME_CORO;
         else
             conn->flags &= ~CONN_SHOULD_RESUME_CORO;
+    }
+
+    return true;
+}
+
+/* A coroutine waiting for a read to complete is resumed once the socket is
+ * readable; otherwise, it's resumed once the socket is writable.  */
+static ALWAYS_INLINE bool
+conn_is_ready(const struct lwan_connection *conn)
+{
+    const enum lwan_connection_flags mask =
+        CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO |
+        ((conn->flags & CONN_MUST_READ) ? CONN_READABLE : CONN_WRITABLE);
 
-        write_events = (conn->flags & CONN_WRITE_EVENTS);
-        if (should_resume_coro == write_events)
+    return (conn->flags & mask) == mask;
+}
+
+static ALWAYS_INLINE void
+resume_coro_if_ready(struct timeout_wheel *wheel, struct lwan_connection *conn,
+    struct coro_switcher *switcher, struct lwan_fd_array *ready)
+{
+    if (!conn_is_ready(conn))
+        return;
+
+    if (!resume_coro(wheel, conn, switcher, 0))
+        return;
+
+    /* Sockets are polled in edge-triggered mode, so there won't be another
+     * event for this connection until a read or write would block: if it
+     * can still make progress, resume it in the next loop iteration. */
+    if (conn_is_ready(conn) && !(conn->flags & CONN_READY_QUEUED)) {
+        int *fd = lwan_fd_array_append(ready);
+
+        if (UNLIKELY(!fd)) {
+            lwan_status_error("Could not queue ready connection");
             return;
+        }
+
+        *fd = lwan_connection_get_fd(wheel->lwan, conn);
+        conn->flags |= CONN_READY_QUEUED;
     }
+}
 
-    struct epoll_event event = {
-        .events = events_by_write_flag[write_events],
-        .data.ptr = conn
-    };
+static void
+resume_ready_conns(struct lwan_thread *t, struct timeout_wheel *wheel,
+    struct coro_switcher *switcher, struct lwan_fd_array *ready,
+    struct lwan_fd_array *next_ready)
+{
+    struct lwan_connection *conns = t->lwan->conns;
+    int *fds = ready->base.base;
 
-    int fd = lwan_connection_get_fd(dq->lwan, conn);
-    if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0))
-        lwan_status_perror("epoll_ctl");
+    for (size_t i = 0; i < ready->base.elements; i++) {
+        struct lwan_connection *conn = &conns[fds[i]];
+
+        /* Flag isn't set if the connection has been closed (and possibly
+         * replaced by a new one) since it was queued. */
+        if (!(conn->flags & CONN_READY_QUEUED))
+            continue;
+
+        conn->flags &= ~CONN_READY_QUEUED;
+        resume_coro_if_ready(wheel, conn, switcher, next_ready);
+        timeout_wheel_touch(wheel, conn);
+    }
 
-    conn->flags ^= CONN_WRITE_EVENTS;
+    /* Keep the storage around for the next time it's used */
+    ready->base.elements = 0;
 }
 
 static void
-death_queue_kill_waiting(struct death_queue_t *dq)
+timeout_wheel_cascade(struct timeout_wheel *wheel, unsigned level, unsigned slot)
 {
-    dq->time++;
+    struct lwan_connection *head = &wheel->slots[level * TIMEOUT_WHEEL_SLOTS + slot];
 
-    while (!death_queue_empty(dq)) {
-        struct lwan_connection *conn = death_queue_idx_to_node(dq, dq->head.next);
+    while (head->next >= 0) {
+        struct lwan_connection *conn = timeout_wheel_idx_to_node(wheel, head->next);
 
-        if (conn->time_to_die > dq->time)
-            return;
+        timeout_wheel_remove(wheel, conn);
+        timeout_wheel_insert(wheel, conn);
+    }
+}
+
+static void
+timeout_wheel_advance(struct timeout_wheel *wheel)
+{
+    unsigned tick;
+
+    while (timeout_wheel_next_tick(wheel, &tick) && tick <= wheel->current) {
+        wheel->now = tick;
+
+        if (!(tick & TIMEOUT_WHEEL_SLOT_MASK)) {
+            if (!((tick >> TIMEOUT_WHEEL_SLOT_BITS) & TIMEOUT_WHEEL_SLOT_MASK)) {
+                timeout_wheel_cascade(wheel, 2,
+                    (tick >> (2 * TIMEOUT_WHEEL_SLOT_BITS)) & TIMEOUT_WHEEL_SLOT_MASK);
+            }
+            timeout_wheel_cascade(wheel, 1,
+                (tick >> TIMEOUT_WHEEL_SLOT_BITS) & TIMEOUT_WHEEL_SLOT_MASK);
+        }
 
-        destroy_coro(dq, conn);
+        struct lwan_connection *head = &wheel->slots[tick & TIMEOUT_WHEEL_SLOT_MASK];
+        while (head->next >= 0)
+            destroy_coro(wheel, timeout_wheel_idx_to_node(wheel, head->next));
     }
 
-    /* Death queue exhausted: reset epoch */
-    dq->time = 0;
+    wheel->now = wheel->current;
 }
 
 static void
-death_queue_kill_all(struct death_queue_t *dq)
+timeout_wheel_kill_all(struct timeout_wheel *wheel)
 {
-    while (!death_queue_empty(dq)) {
-        struct lwan_connection *conn = death_queue_idx_to_node(dq, dq->head.next);
-        destroy_coro(dq, conn);
+    for (size_t i = 0; i < N_ELEMENTS(wheel->slots); i++) {
+        struct lwan_connection *head = &wheel->slots[i];
+
+        while (head->next >= 0)
+            destroy_coro(wheel, timeout_wheel_idx_to_node(wheel, head->next));
     }
 }
 
@@ -280,122 +569,764 @@ update_date_cache(struct lwan_thread *thread)
 }
 
 static ALWAYS_INLINE void
-spawn_coro(struct lwan_connection *conn,
-            struct coro_switcher *switcher, struct death_queue_t *dq)
+start_connection(struct lwan_connection *conn, struct timeout_wheel *wheel,
+    enum lwan_connection_flags phase)
 {
     assert(!conn->coro);
     assert(!(conn->flags & CONN_IS_ALIVE));
     assert(!(conn->flags & CONN_SHOULD_RESUME_CORO));
 
-    conn->coro = coro_new(switcher, process_request_coro, conn);
-    conn->flags = CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO;
+    /* The first thing the coroutine does is reading the request, so it's
+     * only created by resume_coro() once the socket is readable.  New
+     * clients start in CONN_PHASE_HEADER: the first request header has to
+     * arrive within read_header_timeout of the connection being accepted,
+     * not keep_alive_timeout.  */
+    conn->flags |= CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO | CONN_MUST_READ | phase;
 
-    death_queue_insert(dq, conn);
+    timeout_wheel_schedule(wheel, conn);
+    timeout_wheel_insert(wheel, conn);
 }
 
-static int
-grab_command(int pipe_fd)
+static void
+signal_thread(struct lwan_thread *t)
 {
-    int cmd;
-    ssize_t sz = read(pipe_fd, &cmd, sizeof(cmd));
+#if defined(HAS_EVENTFD)
+    uint64_t event = 1;
+#else
+    char event = 0;
+#endif
 
-    if (UNLIKELY(sz < 0))
-        return -1;
-    if (UNLIKELY((size_t)sz < sizeof(cmd)))
-        return -2;
-    return cmd;
+    while (true) {
+        if (LIKELY(write(t->pipe_fd[1], &event, sizeof(event)) >= 0))
+            return;
+
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            /* Counter (or pipe) is full: thread is bound to wake up anyway */
+            return;
+        }
+
+        lwan_status_perror("write");
+        return;
+    }
+}
+
+static void
+consume_signal(int fd)
+{
+#if defined(HAS_EVENTFD)
+    uint64_t event;
+
+    /* Reading an eventfd resets its counter, regardless of how many times
+     * it has been signaled.  */
+    if (UNLIKELY(read(fd, &event, sizeof(event)) < 0 && errno != EAGAIN))
+        lwan_status_perror("read");
+#else
+    char buffer[64];
+
+    while (read(fd, buffer, sizeof(buffer)) == (ssize_t)sizeof(buffer))
+        ;
+#endif
+}
+
+#if defined(HAVE_IO_URING)
+static bool
+uring_watch_conn(struct lwan_uring *ring, struct lwan_connection *conn,
+    int fd, unsigned events)
+{
+    if (UNLIKELY(!lwan_uring_prep_poll(ring, fd, events | POLLRDHUP,
+                                       (uint64_t)(uintptr_t)conn))) {
+        lwan_status_error("Could not poll connection %d", fd);
+        return false;
+    }
+
+    conn->flags |= CONN_POLL_ARMED;
+    ring->in_flight++;
+    return true;
 }
+#endif
 
 static struct lwan_connection *
-watch_client(int epoll_fd, int fd, struct lwan_connection *conns)
+watch_client(struct lwan_thread *t, int fd)
 {
+    struct lwan_connection *conn = &t->lwan->conns[fd];
+
+#if defined(HAVE_IO_URING)
+    if (t->uring)
+        return uring_watch_conn(t->uring, conn, fd, POLLIN) ? conn : NULL;
+#endif
+
+    /* Registered only once for both directions: readiness is tracked in
+     * the connection flags instead of changing the event mask.  */
     struct epoll_event event = {
-        .events = events_by_write_flag[1],
-        .data.ptr = &conns[fd]
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLET,
+        .data.ptr = conn
     };
-    if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
+    if (UNLIKELY(epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+        lwan_status_perror("epoll_ctl");
         return NULL;
+    }
 
-    return &conns[fd];
+    return conn;
 }
 
-static void *
-thread_io_loop(void *data)
+static void
+add_accepted_client(struct lwan_thread *t, int fd, struct timeout_wheel *wheel)
+{
+    struct lwan_connection *conn;
+
+    t->lwan->conns[fd].flags = 0;
+    t->lwan->conns[fd].thread = t;
+
+    conn = watch_client(t, fd);
+    if (UNLIKELY(!conn)) {
+        close(fd);
+        return;
+    }
+
+    ATOMIC_INC(t->stats.live_connections);
+    ATOMIC_INC(t->stats.accepted_connections);
+    start_connection(conn, wheel, CONN_PHASE_HEADER);
+}
+
+static void
+accept_clients(struct lwan_thread *t, struct timeout_wheel *wheel)
+{
+    while (true) {
+        int fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (UNLIKELY(fd < 0)) {
+            switch (errno) {
+            case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                return;
+            case EINTR:
+            case ECONNABORTED:
+                continue;
+            }
+
+            lwan_status_perror("accept");
+            return;
+        }
+
+        add_accepted_client(t, fd, wheel);
+    }
+}
+
+static void
+watch_and_start(struct lwan_thread *t, int fd, struct timeout_wheel *wheel,
+    enum lwan_connection_flags phase)
+{
+    struct lwan_connection *conn = watch_client(t, fd);
+
+    if (UNLIKELY(!conn)) {
+        close(fd);
+        ATOMIC_DEC(t->stats.live_connections);
+        return;
+    }
+
+    start_connection(conn, wheel, phase);
+}
+
+static void
+accept_migrated_clients(struct lwan_thread *t, struct timeout_wheel *wheel)
+{
+    struct lwan_fd_array migrated;
+
+    if (UNLIKELY(pthread_mutex_lock(&t->migration_lock)))
+        return;
+    migrated = t->migrated_fds;
+    lwan_fd_array_init(&t->migrated_fds);
+    pthread_mutex_unlock(&t->migration_lock);
+
+    int *fds = migrated.base.base;
+    for (size_t i = 0; i < migrated.base.elements; i++)
+        watch_and_start(t, fds[i], wheel, CONN_PHASE_KEEP_ALIVE);
+
+    lwan_fd_array_reset(&migrated);
+}
+
+static bool
+accept_pending_clients(struct lwan_thread *t, struct timeout_wheel *wheel)
+{
+    int fd;
+
+    consume_signal(t->pipe_fd[0]);
+
+    if (UNLIKELY(t->lwan->config.migration_threshold))
+        accept_migrated_clients(t, wheel);
+
+    while (spsc_queue_pop(t->pending_fds, &fd)) {
+        /* A negative file descriptor is pushed during shutdown */
+        if (UNLIKELY(fd < 0))
+            return false;
+
+        watch_and_start(t, fd, wheel, CONN_PHASE_HEADER);
+    }
+
+    return true;
+}
+
+static struct lwan_thread *
+least_loaded_thread(struct lwan *l)
+{
+    struct lwan_thread *best = &l->thread.threads[0];
+    unsigned int best_load = ATOMIC_READ(best->stats.live_connections);
+
+    for (int i = 1; i < l->thread.count; i++) {
+        struct lwan_thread *t = &l->thread.threads[i];
+        unsigned int load = ATOMIC_READ(t->stats.live_connections);
+
+        if (load < best_load) {
+            best = t;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+static void
+migrate_if_imbalanced(struct lwan_thread *t, struct timeout_wheel *wheel,
+    struct lwan_connection *conn)
+{
+    struct lwan *l = t->lwan;
+
+    /* Only hibernated connections can be moved: with no coroutine, there
+     * are no pipelined requests waiting in a buffer, no responses being
+     * written, and no buffers still referenced by the kernel.  (Connections
+     * that came through a proxy never hibernate, as they'd lose what the
+     * PROXY header said.)  */
+    if (!(conn->flags & CONN_IS_ALIVE))
+        return;
+    if (conn->coro || !(conn->flags & CONN_KEEP_ALIVE))
+        return;
+
+    struct lwan_thread *target = least_loaded_thread(l);
+    if (target == t)
+        return;
+    if (ATOMIC_READ(t->stats.live_connections) <=
+            ATOMIC_READ(target->stats.live_connections) + l->config.migration_threshold)
+        return;
+
+    int fd = lwan_connection_get_fd(l, conn);
+    if (UNLIKELY(epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)) {
+        lwan_status_perror("epoll_ctl");
+        return;
+    }
+
+    timeout_wheel_remove(wheel, conn);
+    conn->flags = 0;
+    conn->thread = target;
+
+    ATOMIC_DEC(t->stats.live_connections);
+    ATOMIC_INC(target->stats.live_connections);
+    ATOMIC_INC(t->stats.migrated_connections);
+
+    if (UNLIKELY(pthread_mutex_lock(&target->migration_lock)))
+        lwan_status_critical_perror("pthread_mutex_lock");
+    int *slot = lwan_fd_array_append(&target->migrated_fds);
+    if (LIKELY(slot))
+        *slot = fd;
+    pthread_mutex_unlock(&target->migration_lock);
+
+    if (UNLIKELY(!slot)) {
+        lwan_status_error("Could not migrate connection %d", fd);
+        ATOMIC_DEC(target->stats.live_connections);
+        close(fd);
+        return;
+    }
+
+    signal_thread(target);
+}
+
+#if defined(HAS_PTHREAD_SETAFFINITY_NP)
+static void
+pin_to_cpu(struct lwan_thread *t)
+{
+    cpu_set_t set;
+    int r;
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t)t->cpu, &set);
+
+    r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (UNLIKELY(r)) {
+        errno = r;
+        lwan_status_perror("pthread_setaffinity_np");
+    }
+}
+
+static void
+touch_connection_pages(struct lwan_thread *t)
+{
+    const struct lwan *l = t->lwan;
+    const unsigned short n_nodes = l->thread.numa.count;
+    const unsigned short first = l->thread.numa.first[t->numa_node];
+    const unsigned short n_threads = l->thread.numa.first[t->numa_node + 1] - first;
+    const unsigned short self = (unsigned short)(t - l->thread.threads);
+    const size_t page_size = l->thread.numa.conns_per_page * sizeof(struct lwan_connection);
+    volatile char *conns = (volatile char *)l->conns;
+    size_t page;
+    unsigned short index;
+
+    for (index = 0; index < n_threads; index++) {
+        if (l->thread.numa.threads[first + index] == self)
+            break;
+    }
+
+    /* Pages are assigned to nodes in a round-robin fashion, and split
+     * among the threads in each node the same way.  Writing to a page for
+     * the first time allocates it in the node of the writing thread.  */
+    for (page = t->numa_node + (size_t)n_nodes * index;
+         page * page_size < l->conns_size;
+         page += (size_t)n_nodes * n_threads) {
+        conns[page * page_size] = 0;
+    }
+}
+#endif
+
+static uint64_t
+monotonic_usec(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        lwan_status_critical_perror("clock_gettime");
+
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* Time spent spinning is taken from the time the poller would block */
+static ALWAYS_INLINE int
+busy_poll_remaining_timeout(const struct lwan_thread *t, int timeout)
+{
+    if (timeout < 0)
+        return timeout;
+
+    timeout -= (int)(t->lwan->config.busy_poll_budget / 1000);
+    return timeout > 0 ? timeout : 0;
+}
+
+static int
+epoll_wait_busy(struct lwan_thread *t, struct epoll_event *events,
+    int max_events, int timeout)
+{
+    const uint64_t deadline = monotonic_usec() + t->lwan->config.busy_poll_budget;
+
+    do {
+        int n_fds = epoll_wait(t->epoll_fd, events, max_events, 0);
+
+        if (n_fds) {
+            if (n_fds > 0)
+                t->stats.busy_poll_hits++;
+            return n_fds;
+        }
+    } while (monotonic_usec() < deadline);
+
+    t->stats.busy_poll_sleeps++;
+
+    return epoll_wait(t->epoll_fd, events, max_events,
+                      busy_poll_remaining_timeout(t, timeout));
+}
+
+static void
+epoll_io_loop(struct lwan_thread *t, struct coro_switcher *switcher,
+    struct timeout_wheel *wheel)
 {
-    struct lwan_thread *t = data;
     const int epoll_fd = t->epoll_fd;
-    const int read_pipe_fd = t->pipe_fd[0];
     const int max_events = min((int)t->lwan->thread.max_fd, 1024);
     struct lwan *lwan = t->lwan;
-    struct lwan_connection *conns = lwan->conns;
     struct epoll_event *events;
-    struct coro_switcher switcher;
-    struct death_queue_t dq;
+    struct lwan_fd_array ready_lists[2];
+    struct lwan_fd_array *ready = &ready_lists[0];
+    bool busy_poll = false;
     int n_fds;
 
-    lwan_status_debug("Starting IO loop on thread #%d",
-        (unsigned short)(ptrdiff_t)(t - t->lwan->thread.threads) + 1);
-
     events = calloc((size_t)max_events, sizeof(*events));
     if (UNLIKELY(!events))
         lwan_status_critical("Could not allocate memory for events");
 
-    death_queue_init(&dq, lwan);
-
-    pthread_barrier_wait(&lwan->thread.barrier);
+    lwan_fd_array_init(&ready_lists[0]);
+    lwan_fd_array_init(&ready_lists[1]);
 
     for (;;) {
-        switch (n_fds = epoll_wait(epoll_fd, events, max_events,
-                                   death_queue_epoll_timeout(&dq))) {
-        case -1:
+        /* Don't block if there are connections ready to be resumed */
+        const int timeout =
+            ready->base.elements ? 0 : timeout_wheel_epoll_timeout(wheel);
+
+        if (busy_poll && timeout)
+            n_fds = epoll_wait_busy(t, events, max_events, timeout);
+        else
+            n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+
+        /* Only spin while there's activity; idle threads just sleep */
+        busy_poll = lwan->config.busy_poll_budget && n_fds > 0;
+
+        if (UNLIKELY(n_fds < 0)) {
             switch (errno) {
             case EBADF:
             case EINVAL:
                 goto epoll_fd_closed;
             }
             continue;
-        case 0: /* timeout: shutdown waiting sockets */
-            death_queue_kill_waiting(&dq);
-            break;
-        default: /* activity in some of this poller's file descriptor */
+        }
+
+        timeout_wheel_update_clock(wheel);
+
+        if (n_fds) /* activity in some of this poller's file descriptor */
             update_date_cache(t);
 
-            for (struct epoll_event *ep_event = events; n_fds--; ep_event++) {
-                struct lwan_connection *conn;
-
-                if (!ep_event->data.ptr) {
-                    int cmd = grab_command(read_pipe_fd);
-                    if (LIKELY(cmd >= 0)) {
-                        conn = watch_client(epoll_fd, cmd, conns);
-                        spawn_coro(conn, &switcher, &dq);
-                    } else if (UNLIKELY(cmd == -1)) {
-                        continue;
-                    } else if (UNLIKELY(cmd == -2)) {
-                        goto epoll_fd_closed;
-                    } else {
-                        lwan_status_debug("Unknown command received, ignored");
-                        continue;
-                    }
-                } else {
-                    conn = ep_event->data.ptr;
-                    if (UNLIKELY(ep_event->events & (EPOLLRDHUP | EPOLLHUP))) {
-                        destroy_coro(&dq, conn);
-                        continue;
-                    }
-
-                    resume_coro_if_needed(&dq, conn, epoll_fd);
-                }
+        for (struct epoll_event *ep_event = events; n_fds--; ep_event++) {
+            struct lwan_connection *conn;
 
-                death_queue_move_to_last(&dq, conn);
+            if (ep_event->data.ptr == t) {
+                accept_clients(t, wheel);
+                continue;
             }
+
+            if (!ep_event->data.ptr) {
+                if (UNLIKELY(!accept_pending_clients(t, wheel)))
+                    goto epoll_fd_closed;
+                continue;
+            }
+
+            conn = ep_event->data.ptr;
+            if (UNLIKELY(ep_event->events & (EPOLLRDHUP | EPOLLHUP))) {
+                destroy_coro(wheel, conn);
+                continue;
+            }
+
+            /* Errors are reported by the next read or write */
+            if (ep_event->events & (EPOLLIN | EPOLLERR))
+                conn->flags |= CONN_READABLE;
+            if (ep_event->events & (EPOLLOUT | EPOLLERR))
+                conn->flags |= CONN_WRITABLE;
+
+            resume_coro_if_ready(wheel, conn, switcher, ready);
+            timeout_wheel_touch(wheel, conn);
+
+            if (UNLIKELY(lwan->config.migration_threshold))
+                migrate_if_imbalanced(t, wheel, conn);
+        }
+
+        if (ready->base.elements) {
+            struct lwan_fd_array *next_ready =
+                (ready == &ready_lists[0]) ? &ready_lists[1] : &ready_lists[0];
+
+            resume_ready_conns(t, wheel, switcher, ready, next_ready);
+            ready = next_ready;
         }
+
+        /* Expire connections on every iteration, not only when the poller
+         * is idle: otherwise they'd never be reaped under steady load. */
+        timeout_wheel_advance(wheel);
     }
 
 epoll_fd_closed:
+    lwan_fd_array_reset(&ready_lists[0]);
+    lwan_fd_array_reset(&ready_lists[1]);
+    free(events);
+}
+
+#if defined(HAVE_IO_URING)
+static void
+uring_conn_completed(struct lwan_thread *t, struct timeout_wheel *wheel,
+    struct coro_switcher *switcher, uint64_t user_data, int res)
+{
+    struct lwan_connection *conn =
+        (struct lwan_connection *)(uintptr_t)(user_data & ~LWAN_URING_IO);
+    const int fd = lwan_connection_get_fd(t->lwan, conn);
+    unsigned events;
+
+    t->uring->in_flight--;
+
+    if (user_data & LWAN_URING_IO) {
+        conn->flags &= ~CONN_IO_PENDING;
+
+        if (UNLIKELY(!(conn->flags & CONN_IS_ALIVE))) {
+            /* Destroyed while the request was in flight */
+            coro_free(conn->coro);
+            conn->coro = NULL;
+            close(fd);
+            return;
+        }
+
+        /* The coroutine gets the result of what it has submitted, which
+         * might have been an error */
+        if (!resume_coro(wheel, conn, switcher, res))
+            return;
+    } else {
+        conn->flags &= ~CONN_POLL_ARMED;
+
+        if (UNLIKELY(!(conn->flags & CONN_IS_ALIVE))) {
+            /* Destroyed while the poll request was in flight */
+            close(fd);
+            return;
+        }
+
+        if (UNLIKELY(res < 0 || (res & (POLLRDHUP | POLLHUP | POLLERR)))) {
+            destroy_coro(wheel, conn);
+            return;
+        }
+
+        if ((conn->flags & CONN_SHOULD_RESUME_CORO) &&
+                !resume_coro(wheel, conn, switcher, 0))
+            return;
+    }
+
+    /* Poll requests are one-shot, so they're always armed again, with the
+     * same events that would be set in the epoll case, unless the coroutine
+     * is now waiting for I/O it has submitted. */
+    if (!(conn->flags & CONN_IO_PENDING)) {
+        if (conn->flags & CONN_MUST_READ)
+            events = POLLIN;
+        else if (conn->flags & CONN_SHOULD_RESUME_CORO)
+            events = POLLOUT;
+        else
+            events = POLLIN;
+        uring_watch_conn(t->uring, conn, fd, events);
+    }
+
+    timeout_wheel_touch(wheel, conn);
+}
+
+static bool
+uring_accept(struct lwan_thread *t, bool multishot)
+{
+    if (UNLIKELY(!lwan_uring_prep_accept(t->uring, t->listen_fd,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC, multishot,
+                                         (uint64_t)(uintptr_t)t))) {
+        lwan_status_error("Could not accept connections on thread socket");
+        return false;
+    }
+
+    return true;
+}
+
+/* Returns whether the accept request is still active */
+static bool
+uring_accept_completed(struct lwan_thread *t, int res, unsigned flags,
+    bool *multishot, struct timeout_wheel *wheel)
+{
+    if (LIKELY(res >= 0)) {
+        add_accepted_client(t, res, wheel);
+    } else {
+        switch (-res) {
+        case EAGAIN:
+        case EINTR:
+        case ECONNABORTED:
+            break;
+        case EINVAL:
+            if (*multishot) {
+                /* Kernel doesn't support multishot accept */
+                *multishot = false;
+                break;
+            }
+            /* fallthrough */
+        case EBADF:
+        case ENOTSOCK:
+            /* Listening socket has been closed */
+            return false;
+        default:
+            errno = -res;
+            lwan_status_perror("accept");
+        }
+    }
+
+    if (flags & IORING_CQE_F_MORE)
+        return true;
+    return uring_accept(t, *multishot);
+}
+
+static int
+uring_wait_busy(struct lwan_thread *t, int timeout)
+{
+    const uint64_t deadline = monotonic_usec() + t->lwan->config.busy_poll_budget;
+
+    do {
+        int r = lwan_uring_submit_and_wait(t->uring, 0);
+
+        if (r < 0)
+            return r;
+        if (lwan_uring_peek_cqe(t->uring)) {
+            t->stats.busy_poll_hits++;
+            return r;
+        }
+    } while (monotonic_usec() < deadline);
+
+    t->stats.busy_poll_sleeps++;
+
+    return lwan_uring_submit_and_wait(t->uring,
+                                      busy_poll_remaining_timeout(t, timeout));
+}
+
+static void
+uring_io_loop(struct lwan_thread *t, struct coro_switcher *switcher,
+    struct timeout_wheel *wheel)
+{
+    struct lwan_uring *ring = t->uring;
+    bool accepting = false;
+    bool multishot = true;
+    bool busy_poll = false;
+
+    if (UNLIKELY(!lwan_uring_prep_poll(ring, t->pipe_fd[0], POLLIN, 0)))
+        lwan_status_critical("Could not poll thread event file descriptor");
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        int r;
+
+        /* Poll requests queued while handling the previous batch are
+         * submitted with the same system call that waits for the next. */
+        const int timeout = timeout_wheel_epoll_timeout(wheel);
+
+        if (busy_poll && timeout)
+            r = uring_wait_busy(t, timeout);
+        else
+            r = lwan_uring_submit_and_wait(ring, timeout);
+        if (UNLIKELY(r < 0)) {
+            errno = -r;
+            lwan_status_perror("io_uring_enter");
+            continue;
+        }
+
+        timeout_wheel_update_clock(wheel);
+
+        cqe = lwan_uring_peek_cqe(ring);
+        if (cqe)
+            update_date_cache(t);
+
+        /* Only spin while there's activity; idle threads just sleep */
+        busy_poll = t->lwan->config.busy_poll_budget && cqe;
+
+        for (; cqe; cqe = lwan_uring_peek_cqe(ring)) {
+            const uint64_t user_data = cqe->user_data;
+            const unsigned flags = cqe->flags;
+            const int res = cqe->res;
+
+            lwan_uring_cqe_seen(ring);
+
+            if (user_data == URING_IGNORE)
+                continue;
+
+            if (user_data == (uint64_t)(uintptr_t)t) {
+                accepting = uring_accept_completed(t, res, flags, &multishot,
+                    wheel);
+                continue;
+            }
+
+            if (!user_data) {
+                if (UNLIKELY(!accept_pending_clients(t, wheel)))
+                    return;
+
+                /* Listening socket is set up after threads are running:
+                 * it's only known after being woken up.  */
+                if (!accepting && t->listen_fd >= 0)
+                    accepting = uring_accept(t, multishot);
+
+                if (UNLIKELY(!lwan_uring_prep_poll(ring, t->pipe_fd[0], POLLIN, 0)))
+                    lwan_status_critical("Could not poll thread event file descriptor");
+                continue;
+            }
+
+            uring_conn_completed(t, wheel, switcher, user_data, res);
+        }
+
+        timeout_wheel_advance(wheel);
+    }
+}
+
+/* Requests in flight might still be using memory owned by connections, and
+ * destroyed connections only have their file descriptors closed once their
+ * requests complete: every connection is destroyed (cancelling what it has
+ * submitted), and the completions are waited for before the ring goes
+ * away. */
+static void
+uring_drain(struct lwan_thread *t, struct coro_switcher *switcher,
+    struct timeout_wheel *wheel)
+{
+    struct lwan_uring *ring = t->uring;
+
+    timeout_wheel_kill_all(wheel);
+
+    while (ring->in_flight) {
+        struct io_uring_cqe *cqe;
+
+        if (lwan_uring_submit_and_wait(ring, 1000) < 0 ||
+                !(cqe = lwan_uring_peek_cqe(ring))) {
+            lwan_status_warning("%u io_uring requests did not complete",
+                                ring->in_flight);
+            return;
+        }
+
+        for (; cqe; cqe = lwan_uring_peek_cqe(ring)) {
+            const uint64_t user_data = cqe->user_data;
+            const int res = cqe->res;
+
+            lwan_uring_cqe_seen(ring);
+
+            if (user_data == URING_IGNORE || !user_data)
+                continue;
+
+            if (user_data == (uint64_t)(uintptr_t)t) {
+                /* Accepted while shutting down */
+                if (res >= 0)
+                    close(res);
+                continue;
+            }
+
+            uring_conn_completed(t, wheel, switcher, user_data, res);
+        }
+    }
+}
+#endif
+
+static void *
+thread_io_loop(void *data)
+{
+    struct lwan_thread *t = data;
+    struct lwan *lwan = t->lwan;
+    struct coro_switcher switcher;
+    struct timeout_wheel wheel;
+
+    lwan_status_debug("Starting IO loop on thread #%d",
+        (unsigned short)(ptrdiff_t)(t - t->lwan->thread.threads) + 1);
+
+#if defined(HAS_PTHREAD_SETAFFINITY_NP)
+    if (t->cpu >= 0)
+        pin_to_cpu(t);
+    if (lwan->thread.numa.count)
+        touch_connection_pages(t);
+#endif
+
+    timeout_wheel_init(&wheel, lwan);
+
     pthread_barrier_wait(&lwan->thread.barrier);
 
-    death_queue_kill_all(&dq);
-    free(events);
+#if defined(HAVE_IO_URING)
+    if (t->uring) {
+        uring_io_loop(t, &switcher, &wheel);
+        uring_drain(t, &switcher, &wheel);
+
+        /* Whatever is still pending (accepting connections, polling the
+         * eventfd) is cancelled when the ring is torn down.  */
+        lwan_uring_free(t->uring);
+        free(t->uring);
+        t->uring = NULL;
+    } else
+#endif
+    epoll_io_loop(t, &switcher, &wheel);
+
+    pthread_barrier_wait(&lwan->thread.barrier);
+
+    timeout_wheel_kill_all(&wheel);
+    coro_pool_drain();
+    lwan_request_buffer_pool_drain();
 
     return NULL;
 }
@@ -405,9 +1336,31 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
 {
     pthread_attr_t attr;
 
-    memset(thread, 0, sizeof(*thread));
     thread->lwan = l;
+    thread->listen_fd = -1;
+
+    if (pthread_mutex_init(&thread->migration_lock, NULL))
+        lwan_status_critical_perror("pthread_mutex_init");
+    lwan_fd_array_init(&thread->migrated_fds);
+
+#if defined(HAVE_IO_URING)
+    if (l->config.use_io_uring) {
+        int r;
 
+        thread->uring = malloc(sizeof(*thread->uring));
+        if (!thread->uring)
+            lwan_status_critical("Could not allocate memory for io_uring");
+
+        r = lwan_uring_init(thread->uring,
+                            (unsigned)min((int)l->thread.max_fd, 1024));
+        if (r < 0) {
+            errno = -r;
+            lwan_status_critical_perror("io_uring_setup");
+        }
+
+        thread->epoll_fd = -1;
+    } else
+#endif
     if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         lwan_status_critical_perror("epoll_create");
 
@@ -420,12 +1373,27 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
     if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
         lwan_status_critical_perror("pthread_attr_setdetachstate");
 
+    thread->pending_fds = malloc(sizeof(*thread->pending_fds));
+    if (!thread->pending_fds ||
+            spsc_queue_init(thread->pending_fds,
+                            (size_t)min((int)l->thread.max_fd, 4096)) < 0)
+        lwan_status_critical("Could not initialize pending connection queue");
+
+#if defined(HAS_EVENTFD)
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+        lwan_status_critical_perror("eventfd");
+    thread->pipe_fd[0] = thread->pipe_fd[1] = event_fd;
+#else
     if (pipe2(thread->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0)
         lwan_status_critical_perror("pipe");
+#endif
 
-    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
-    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0], &event) < 0)
-        lwan_status_critical_perror("epoll_ctl");
+    if (thread->epoll_fd >= 0) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0], &event) < 0)
+            lwan_status_critical_perror("epoll_ctl");
+    }
 
     if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
         lwan_status_critical_perror("pthread_create");
@@ -434,14 +1402,197 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
         lwan_status_critical_perror("pthread_attr_destroy");
 }
 
+static void
+queue_client(struct lwan_thread *t, int fd)
+{
+    bool was_empty;
+
+    while (UNLIKELY(!spsc_queue_push(t->pending_fds, fd, &was_empty))) {
+        /* Queue is full: make sure the thread is awake to drain it and
+         * give it a chance to run before trying again.  */
+        signal_thread(t);
+        sched_yield();
+    }
+
+    /* Only signal the thread if it has already gone through everything
+     * that has been queued before; otherwise, it'll pick this one up as
+     * well while it's draining the queue.  */
+    if (was_empty)
+        signal_thread(t);
+}
+
 void
 lwan_thread_add_client(struct lwan_thread *t, int fd)
 {
     t->lwan->conns[fd].flags = 0;
     t->lwan->conns[fd].thread = t;
 
-    if (UNLIKELY(write(t->pipe_fd[1], &fd, sizeof(int)) < 0))
-        lwan_status_perror("write");
+    /* Counted here, rather than by the I/O thread, so that schedulers see
+     * the new connection right away.  */
+    ATOMIC_INC(t->stats.live_connections);
+    ATOMIC_INC(t->stats.accepted_connections);
+
+    queue_client(t, fd);
+}
+
+void
+lwan_thread_add_listener(struct lwan_thread *t, int fd)
+{
+    /* The listening socket is identified by having the thread itself as
+     * the epoll data pointer: it can't be mistaken for a connection, as
+     * those always point somewhere inside the lwan->conns array.  */
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = t };
+
+    t->listen_fd = fd;
+
+#if defined(HAVE_IO_URING)
+    if (t->uring) {
+        /* Only the I/O thread submits requests to its ring: wake it up so
+         * it starts accepting connections on this socket.  */
+        signal_thread(t);
+        return;
+    }
+#endif
+
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        lwan_status_critical_perror("epoll_ctl");
+}
+
+#if defined(HAS_PTHREAD_SETAFFINITY_NP)
+static int
+cpu_numa_node(unsigned int cpu)
+{
+    char path[64];
+    struct dirent *ent;
+    DIR *dir;
+    int node = 0;
+
+    /* Each CPU directory has a "nodeN" link to the node it belongs to.  If
+     * it can't be found, assume a machine without NUMA.  */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    while ((ent = readdir(dir))) {
+        if (!strncmp(ent->d_name, "node", 4) && lwan_char_isdigit(ent->d_name[4])) {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+static void
+setup_affinity(struct lwan *l)
+{
+    unsigned int cpus[CPU_SETSIZE];
+    int n_cpus = parse_cpu_list(l->config.thread_affinity, cpus, CPU_SETSIZE);
+    unsigned short n_nodes = 0;
+    int *node_ids;
+
+    if (n_cpus <= 0) {
+        lwan_status_error("Invalid CPU list for I/O threads: %s",
+            l->config.thread_affinity);
+        return;
+    }
+
+    node_ids = calloc(l->thread.count, sizeof(*node_ids));
+    if (!node_ids)
+        lwan_status_critical("Could not allocate memory for NUMA nodes");
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        struct lwan_thread *t = &l->thread.threads[i];
+        int node;
+        unsigned short j;
+
+        t->cpu = (int)cpus[i % n_cpus];
+
+        node = cpu_numa_node((unsigned int)t->cpu);
+        for (j = 0; j < n_nodes && node_ids[j] != node; j++)
+            ;
+        if (j == n_nodes)
+            node_ids[n_nodes++] = node;
+        t->numa_node = j;
+    }
+
+    free(node_ids);
+
+    lwan_status_info("Pinning I/O threads to CPUs %s (%d NUMA nodes)",
+        l->config.thread_affinity, n_nodes);
+
+    if (n_nodes < 2)
+        return;
+
+    l->thread.numa.first = calloc(n_nodes + 1u, sizeof(unsigned short));
+    l->thread.numa.threads = calloc(l->thread.count, sizeof(unsigned short));
+    if (!l->thread.numa.first || !l->thread.numa.threads)
+        lwan_status_critical("Could not allocate memory for NUMA nodes");
+
+    /* Group threads by node */
+    unsigned short pos = 0;
+    for (unsigned short node = 0; node < n_nodes; node++) {
+        l->thread.numa.first[node] = pos;
+
+        for (unsigned short i = 0; i < l->thread.count; i++) {
+            if (l->thread.threads[i].numa_node == node)
+                l->thread.numa.threads[pos++] = i;
+        }
+    }
+    l->thread.numa.first[n_nodes] = pos;
+
+    l->thread.numa.conns_per_page =
+        (unsigned int)sysconf(_SC_PAGESIZE) / sizeof(struct lwan_connection);
+    l->thread.numa.count = n_nodes;
+}
+#else
+static void
+setup_affinity(struct lwan *l)
+{
+    lwan_status_warning("Can't pin I/O threads to CPUs %s: not supported "
+                        "on this platform", l->config.thread_affinity);
+}
+#endif
+
+#if defined(HAVE_IO_URING)
+static bool
+uring_supported(void)
+{
+    struct lwan_uring ring;
+    int r = lwan_uring_init(&ring, 2);
+
+    if (r < 0) {
+        errno = -r;
+        lwan_status_perror("Could not use io_uring, falling back to epoll");
+        return false;
+    }
+
+    lwan_uring_free(&ring);
+    return true;
+}
+#endif
+
+static void
+setup_event_backend(struct lwan *l)
+{
+#if defined(HAVE_IO_URING)
+    if (!uring_supported()) {
+        l->config.use_io_uring = false;
+        return;
+    }
+
+    if (l->config.migration_threshold) {
+        lwan_status_warning("Connection migration not supported with io_uring");
+        l->config.migration_threshold = 0;
+    }
+
+    lwan_status_info("Using io_uring in I/O threads");
+#else
+    lwan_status_warning("Built without io_uring support, using epoll");
+    l->config.use_io_uring = false;
+#endif
 }
 
 void
@@ -456,6 +1607,13 @@ lwan_thread_init(struct lwan *l)
     if (!l->thread.threads)
         lwan_status_critical("Could not allocate memory for threads");
 
+    for (short i = 0; i < l->thread.count; i++)
+        l->thread.threads[i].cpu = -1;
+    if (l->config.thread_affinity)
+        setup_affinity(l);
+    if (l->config.use_io_uring)
+        setup_event_backend(l);
+
     for (short i = 0; i < l->thread.count; i++)
         create_thread(l, &l->thread.threads[i]);
 
@@ -464,6 +1622,27 @@ lwan_thread_init(struct lwan *l)
     lwan_status_debug("IO threads created and ready to serve");
 }
 
+bool
+lwan_get_thread_stats(const struct lwan *l, int thread,
+    struct lwan_thread_stats *stats)
+{
+    const struct lwan_thread *t;
+
+    if (UNLIKELY(thread < 0 || thread >= l->thread.count))
+        return false;
+
+    t = &l->thread.threads[thread];
+    *stats = (struct lwan_thread_stats) {
+        .live_connections = ATOMIC_READ(t->stats.live_connections),
+        .accepted_connections = ATOMIC_READ(t->stats.accepted_connections),
+        .migrated_connections = ATOMIC_READ(t->stats.migrated_connections),
+        .busy_poll_hits = ATOMIC_READ(t->stats.busy_poll_hits),
+        .busy_poll_sleeps = ATOMIC_READ(t->stats.busy_poll_sleeps),
+    };
+
+    return true;
+}
+
 void
 lwan_thread_shutdown(struct lwan *l)
 {
@@ -471,28 +1650,21 @@ lwan_thread_shutdown(struct lwan *l)
 
     for (int i = l->thread.count - 1; i >= 0; i--) {
         struct lwan_thread *t = &l->thread.threads[i];
-        char less_than_int = 0;
-        ssize_t r;
 
-        lwan_status_debug("Closing epoll for thread %d (fd=%d)", i,
-            t->epoll_fd);
-
-        /* Close the epoll_fd and write less than an int to signal the
-         * thread to gracefully finish.  */
-        close(t->epoll_fd);
-
-        while (true) {
-            r = write(t->pipe_fd[1], &less_than_int, sizeof(less_than_int));
-
-            if (r >= 0)
-                break;
-
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
+        if (t->listen_fd >= 0) {
+            lwan_status_debug("Closing listening socket for thread %d (fd=%d)",
+                i, t->listen_fd);
+            close(t->listen_fd);
+        }
 
-            lwan_status_error("Could not write to I/O thread (%d) pipe to shutdown", i);
-            break;
+        /* Close the epoll_fd (if any) and queue a negative file descriptor
+         * to signal the thread to gracefully finish.  */
+        if (t->epoll_fd >= 0) {
+            lwan_status_debug("Closing epoll for thread %d (fd=%d)", i,
+                t->epoll_fd);
+            close(t->epoll_fd);
         }
+        queue_client(t, -1);
     }
 
     pthread_barrier_wait(&l->thread.barrier);
@@ -501,14 +1673,38 @@ lwan_thread_shutdown(struct lwan *l)
     for (int i = l->thread.count - 1; i >= 0; i--) {
         struct lwan_thread *t = &l->thread.threads[i];
 
+#if defined(HAS_EVENTFD)
+        lwan_status_debug("Closing eventfd (%d)", t->pipe_fd[0]);
+        close(t->pipe_fd[0]);
+#else
         lwan_status_debug("Closing pipe (%d, %d)", t->pipe_fd[0],
             t->pipe_fd[1]);
         close(t->pipe_fd[0]);
         close(t->pipe_fd[1]);
+#endif
+        spsc_queue_free(t->pending_fds);
+        free(t->pending_fds);
 
         lwan_status_debug("Waiting for thread %d to finish", i);
         pthread_join(l->thread.threads[i].self, NULL);
+
+        /* Connections migrated to this thread after it stopped polling */
+        int *fds = t->migrated_fds.base.base;
+        for (size_t j = 0; j < t->migrated_fds.base.elements; j++)
+            close(fds[j]);
+        lwan_fd_array_reset(&t->migrated_fds);
+        pthread_mutex_destroy(&t->migration_lock);
+
+        lwan_status_debug("Thread %d: %lu connections accepted, %lu migrated away",
+            i, t->stats.accepted_connections, t->stats.migrated_connections);
+        if (l->config.busy_poll_budget) {
+            lwan_status_info("Thread %d: busy polling found events %lu times, "
+                "slept %lu times", i, t->stats.busy_poll_hits,
+                t->stats.busy_poll_sleeps);
+        }
     }
 
     free(l->thread.threads);
+    free(l->thread.numa.first);
+    free(l->thread.numa.threads);
 }
@@ -0,0 +1,365 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "lwan.h"
+#include "lwan-uring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, const void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+        flags, arg, arg_size);
+}
+
+int
+lwan_uring_init(struct lwan_uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    int saved_errno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -errno;
+
+    /* Completions must never be dropped (the poll requests would be lost
+     * and connections would stall), and timeouts are passed directly to
+     * io_uring_enter().  Kernels without these are treated as if they
+     * didn't support io_uring at all.  */
+    if (!(params.features & IORING_FEAT_NODROP) ||
+            !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        return -ENOSYS;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto out_close;
+
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+        goto out_unmap_sq;
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto out_unmap_cq;
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+
+out_unmap_cq:
+    saved_errno = errno;
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    errno = saved_errno;
+out_unmap_sq:
+    saved_errno = errno;
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    errno = saved_errno;
+out_close:
+    saved_errno = errno;
+    close(ring->fd);
+    return -saved_errno;
+}
+
+void
+lwan_uring_free(struct lwan_uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static int
+submit(struct lwan_uring *ring, unsigned min_complete, unsigned flags,
+    const void *arg, size_t arg_size)
+{
+    while (true) {
+        int r = io_uring_enter(ring->fd, ring->to_submit, min_complete,
+            flags, arg, arg_size);
+
+        if (LIKELY(r >= 0)) {
+            ring->to_submit -= (unsigned)r;
+            return r;
+        }
+
+        switch (errno) {
+        case EINTR:
+            if (min_complete)
+                return 0;
+            continue;
+        case ETIME:
+            return 0;
+        case EAGAIN:
+        case EBUSY:
+            /* Completion queue is backed up; waiting (or reaping what's
+             * there already) will make room.  */
+            return 0;
+        }
+
+        return -errno;
+    }
+}
+
+struct io_uring_sqe *
+lwan_uring_get_sqe(struct lwan_uring *ring)
+{
+    const unsigned tail = *ring->sq_tail;
+
+    if (UNLIKELY(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)) {
+        /* Submission queue is full: flush it before queueing more */
+        if (submit(ring, 0, 0, NULL, 0) < 0 ||
+                tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+bool
+lwan_uring_prep_poll(struct lwan_uring *ring, int fd, unsigned events,
+    uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    /* Kernel expects the two halves of the mask swapped */
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+bool
+lwan_uring_prep_accept(struct lwan_uring *ring, int fd, int flags,
+    bool multishot, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = (uint32_t)flags;
+    if (multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+/* Lengths are 32-bit in submission queue entries; larger transfers are
+ * completed as short reads or writes.  */
+static ALWAYS_INLINE uint32_t
+sqe_len(size_t len)
+{
+    return len > INT32_MAX ? INT32_MAX : (uint32_t)len;
+}
+
+bool
+lwan_uring_prep_send(struct lwan_uring *ring, int fd, const void *buf,
+    size_t len, int flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = sqe_len(len);
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+bool
+lwan_uring_prep_sendmsg(struct lwan_uring *ring, int fd,
+    const struct msghdr *msg, int flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+bool
+lwan_uring_prep_recv(struct lwan_uring *ring, int fd, void *buf, size_t len,
+    int flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = sqe_len(len);
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+/* Offsets are -1 for pipes (and other files without a position) */
+bool
+lwan_uring_prep_splice(struct lwan_uring *ring, int fd_in, int64_t off_in,
+    int fd_out, int64_t off_out, size_t len, unsigned flags,
+    uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (uint64_t)off_in;
+    sqe->fd = fd_out;
+    sqe->off = (uint64_t)off_out;
+    sqe->len = sqe_len(len);
+    sqe->splice_flags = flags;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+bool
+lwan_uring_prep_cancel(struct lwan_uring *ring, uint64_t target,
+    uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return false;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+int
+lwan_uring_submit_and_wait(struct lwan_uring *ring, int timeout_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+    };
+
+    if (lwan_uring_peek_cqe(ring)) {
+        /* Completions already available: just submit without waiting */
+        return submit(ring, 0, 0, NULL, 0);
+    }
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    return submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg));
+}
+
+struct io_uring_cqe *
+lwan_uring_peek_cqe(struct lwan_uring *ring)
+{
+    const unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+lwan_uring_cqe_seen(struct lwan_uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,76 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* Requests made on behalf of a connection carry its address as user_data.
+ * Socket I/O submitted by its coroutine (whose result is handed back to it)
+ * is told apart from poll requests by this bit.  */
+#define LWAN_URING_IO ((uint64_t)1)
+
+/* Minimal io_uring wrapper, talking to the kernel through the raw system
+ * calls.  Submissions are batched until lwan_uring_submit_and_wait() is
+ * called, which also waits for completions.  */
+struct lwan_uring {
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit;
+
+    /* Poll and I/O requests for connections that haven't completed yet */
+    unsigned in_flight;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int lwan_uring_init(struct lwan_uring *ring, unsigned entries);
+void lwan_uring_free(struct lwan_uring *ring);
+
+struct io_uring_sqe *lwan_uring_get_sqe(struct lwan_uring *ring);
+bool lwan_uring_prep_poll(struct lwan_uring *ring, int fd, unsigned events,
+    uint64_t user_data);
+bool lwan_uring_prep_accept(struct lwan_uring *ring, int fd, int flags,
+    bool multishot, uint64_t user_data);
+bool lwan_uring_prep_send(struct lwan_uring *ring, int fd, const void *buf,
+    size_t len, int flags, uint64_t user_data);
+bool lwan_uring_prep_sendmsg(struct lwan_uring *ring, int fd,
+    const struct msghdr *msg, int flags, uint64_t user_data);
+bool lwan_uring_prep_recv(struct lwan_uring *ring, int fd, void *buf,
+    size_t len, int flags, uint64_t user_data);
+bool lwan_uring_prep_splice(struct lwan_uring *ring, int fd_in, int64_t off_in,
+    int fd_out, int64_t off_out, size_t len, unsigned flags,
+    uint64_t user_data);
+bool lwan_uring_prep_cancel(struct lwan_uring *ring, uint64_t target,
+    uint64_t user_data);
+int lwan_uring_submit_and_wait(struct lwan_uring *ring, int timeout_ms);
+
+struct io_uring_cqe *lwan_uring_peek_cqe(struct lwan_uring *ring);
+void lwan_uring_cqe_seen(struct lwan_uring *ring);
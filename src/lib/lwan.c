@@ -27,6 +27,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -44,13 +45,27 @@
 static const struct lwan_config default_config = {
     .listener = "localhost:8080",
     .keep_alive_timeout = 15,
+    .read_header_timeout = 15,
+    .read_body_timeout = 15,
+    .write_timeout = 15,
+    .min_write_rate = 1024,
+    .zerocopy_threshold = 0,
     .quiet = false,
     .reuse_port = false,
+    .per_thread_listeners = false,
+    .use_io_uring = false,
+    .defer_accept = false,
     .proxy_protocol = false,
     .allow_cors = false,
     .expires = 1 * ONE_WEEK,
+    .scheduler = SCHEDULER_ROUND_ROBIN,
+    .migration_threshold = 0,
+    .busy_poll_budget = 0,
+    .coro_stack_size = 0,
+    .coro_pool_size = 64,
     .n_threads = 0,
     .max_post_data_size = 10 * DEFAULT_BUFFER_SIZE,
+    .max_request_header_size = 16 * DEFAULT_BUFFER_SIZE,
     .allow_post_temp_file = false,
 };
 
@@ -235,6 +250,9 @@ static void parse_listener_prefix(struct config *c, struct config_line *l, struc
                   config_error(c, "Could not find handler \"%s\"", l->value);
                   goto out;
               }
+          } else if (streq(l->key, "stream_body")) {
+              if (parse_bool(l->value, false))
+                  url_map.flags |= HANDLER_STREAM_BODY;
           } else {
               hash_add(hash, strdup(l->key), strdup(l->value));
           }
@@ -410,12 +428,39 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             if (streq(line.key, "keep_alive_timeout")) {
                 lwan->config.keep_alive_timeout = (unsigned short)parse_long(line.value,
                             default_config.keep_alive_timeout);
+            } else if (streq(line.key, "read_header_timeout")) {
+                lwan->config.read_header_timeout = (unsigned short)parse_long(line.value,
+                            default_config.read_header_timeout);
+            } else if (streq(line.key, "read_body_timeout")) {
+                lwan->config.read_body_timeout = (unsigned short)parse_long(line.value,
+                            default_config.read_body_timeout);
+            } else if (streq(line.key, "write_timeout")) {
+                lwan->config.write_timeout = (unsigned short)parse_long(line.value,
+                            default_config.write_timeout);
+            } else if (streq(line.key, "zerocopy_threshold")) {
+                long threshold = parse_long(line.value,
+                            (long)default_config.zerocopy_threshold);
+                if (threshold < 0)
+                    config_error(conf, "Negative zero-copy threshold");
+                lwan->config.zerocopy_threshold = (size_t)threshold;
+            } else if (streq(line.key, "min_write_rate")) {
+                lwan->config.min_write_rate = (unsigned int)parse_long(line.value,
+                            (long)default_config.min_write_rate);
             } else if (streq(line.key, "quiet")) {
                 lwan->config.quiet = parse_bool(line.value,
                             default_config.quiet);
             } else if (streq(line.key, "reuse_port")) {
                 lwan->config.reuse_port = parse_bool(line.value,
                             default_config.reuse_port);
+            } else if (streq(line.key, "per_thread_listeners")) {
+                lwan->config.per_thread_listeners = parse_bool(line.value,
+                            default_config.per_thread_listeners);
+            } else if (streq(line.key, "io_uring")) {
+                lwan->config.use_io_uring = parse_bool(line.value,
+                            default_config.use_io_uring);
+            } else if (streq(line.key, "defer_accept")) {
+                lwan->config.defer_accept = parse_bool(line.value,
+                            default_config.defer_accept);
             } else if (streq(line.key, "proxy_protocol")) {
                 lwan->config.proxy_protocol = parse_bool(line.value,
                             default_config.proxy_protocol);
@@ -425,6 +470,49 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             } else if (streq(line.key, "expires")) {
                 lwan->config.expires = parse_time_period(line.value,
                             default_config.expires);
+            } else if (streq(line.key, "scheduler")) {
+                if (streq(line.value, "round_robin"))
+                    lwan->config.scheduler = SCHEDULER_ROUND_ROBIN;
+                else if (streq(line.value, "least_loaded"))
+                    lwan->config.scheduler = SCHEDULER_LEAST_LOADED;
+                else if (streq(line.value, "power_of_two"))
+                    lwan->config.scheduler = SCHEDULER_POWER_OF_TWO;
+                else
+                    config_error(conf, "Unknown scheduler: %s", line.value);
+            } else if (streq(line.key, "migration_threshold")) {
+                long threshold = parse_long(line.value,
+                            (long)default_config.migration_threshold);
+                if (threshold < 0)
+                    config_error(conf, "Negative migration threshold");
+                lwan->config.migration_threshold = (unsigned int)threshold;
+            } else if (streq(line.key, "busy_poll_budget")) {
+                long budget = parse_long(line.value,
+                            (long)default_config.busy_poll_budget);
+                if (budget < 0 || budget > INT_MAX)
+                    config_error(conf, "Invalid busy polling budget");
+                lwan->config.busy_poll_budget = (unsigned int)budget;
+            } else if (streq(line.key, "coro_stack_size")) {
+                long size = parse_long(line.value,
+                            (long)default_config.coro_stack_size);
+                if (size < 0)
+                    config_error(conf, "Negative coroutine stack size");
+                lwan->config.coro_stack_size = (size_t)size;
+            } else if (streq(line.key, "coro_pool_size")) {
+                long size = parse_long(line.value,
+                            (long)default_config.coro_pool_size);
+                if (size < 0 || size > INT_MAX)
+                    config_error(conf, "Invalid coroutine pool size");
+                lwan->config.coro_pool_size = (unsigned int)size;
+            } else if (streq(line.key, "thread_affinity")) {
+                if (parse_cpu_list(line.value, NULL, 0) <= 0)
+                    config_error(conf, "Invalid CPU list: %s", line.value);
+                free(lwan->config.thread_affinity);
+                lwan->config.thread_affinity = strdup(line.value);
+            } else if (streq(line.key, "job_thread_affinity")) {
+                if (parse_cpu_list(line.value, NULL, 0) <= 0)
+                    config_error(conf, "Invalid CPU list: %s", line.value);
+                free(lwan->config.job_thread_affinity);
+                lwan->config.job_thread_affinity = strdup(line.value);
             } else if (streq(line.key, "error_template")) {
                 free(lwan->config.error_template);
                 lwan->config.error_template = strdup(line.value);
@@ -440,6 +528,13 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                 else if (max_post_data_size > 128 * 1<<20)
                     config_error(conf, "Maximum post data can't be over 128MiB");
                 lwan->config.max_post_data_size = (size_t)max_post_data_size;
+            } else if (streq(line.key, "max_request_header_size")) {
+                long size = parse_long(line.value,
+                            (long)default_config.max_request_header_size);
+                if (size < DEFAULT_BUFFER_SIZE || size > 16 * DEFAULT_BUFFER_SIZE)
+                    config_error(conf, "Maximum request header size must be between %d and %d bytes",
+                                 DEFAULT_BUFFER_SIZE, 16 * DEFAULT_BUFFER_SIZE);
+                lwan->config.max_request_header_size = (size_t)size;
             } else if (streq(line.key, "allow_temp_files")) {
                 lwan->config.allow_post_temp_file = !!strstr(line.value, "post");
             } else {
@@ -506,10 +601,14 @@ allocate_connections(struct lwan *l, size_t max_open_files)
 {
     const size_t sz = max_open_files * sizeof(struct lwan_connection);
 
-    if (posix_memalign((void **)&l->conns, 64, align_to_size(sz, 64)))
-        lwan_status_critical_perror("aligned_alloc");
-
-    memset(l->conns, 0, sz);
+    /* Anonymous mappings are zero-filled and page-aligned; pages are only
+     * backed by memory once touched, which allows I/O threads to place
+     * them in their own NUMA node.  */
+    l->conns_size = align_to_size(sz, 64);
+    l->conns = mmap(NULL, l->conns_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (l->conns == MAP_FAILED)
+        lwan_status_critical_perror("mmap");
 }
 
 static unsigned short int
@@ -542,6 +641,10 @@ lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     memset(l, 0, sizeof(*l));
     memcpy(&l->config, config, sizeof(*config));
     l->config.listener = strdup(l->config.listener);
+    if (l->config.thread_affinity)
+        l->config.thread_affinity = strdup(l->config.thread_affinity);
+    if (l->config.job_thread_affinity)
+        l->config.job_thread_affinity = strdup(l->config.job_thread_affinity);
 
     /* Initialize status first, as it is used by other things during
      * their initialization. */
@@ -565,6 +668,11 @@ lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
         lwan_status_init(l);
     }
 
+    if (l->config.job_thread_affinity)
+        lwan_job_thread_set_affinity(l->config.job_thread_affinity);
+
+    coro_pool_set_limits(l->config.coro_stack_size, l->config.coro_pool_size);
+
     lwan_response_init(l);
 
     /* Continue initialization as normal. */
@@ -606,6 +714,8 @@ lwan_shutdown(struct lwan *l)
     free(l->config.listener);
     free(l->config.error_template);
     free(l->config.config_file_path);
+    free(l->config.thread_affinity);
+    free(l->config.job_thread_affinity);
 
     lwan_job_thread_shutdown();
     lwan_thread_shutdown(l);
@@ -613,19 +723,33 @@ lwan_shutdown(struct lwan *l)
     lwan_status_debug("Shutting down URL handlers");
     lwan_trie_destroy(&l->url_map_trie);
 
-    free(l->conns);
+    munmap(l->conns, l->conns_size);
 
     lwan_response_shutdown(l);
     lwan_tables_shutdown();
     lwan_status_shutdown(l);
     lwan_http_authorize_shutdown();
     lwan_module_shutdown(l);
+
+    coro_pool_drain();
 }
 
-static ALWAYS_INLINE void
-schedule_client(struct lwan *l, int fd)
+static ALWAYS_INLINE int
+schedule_round_robin(const struct lwan *l, int fd)
 {
     int thread;
+
+    if (l->thread.numa.count) {
+        /* Pick a thread in the node that first-touched the page where
+         * this connection lives, pairing connections as below.  */
+        const unsigned int page = (unsigned int)fd / l->thread.numa.conns_per_page;
+        const unsigned short node = (unsigned short)(page % l->thread.numa.count);
+        const unsigned short first = l->thread.numa.first[node];
+        const int n_threads = l->thread.numa.first[node + 1] - first;
+
+        return l->thread.numa.threads[first + ((fd - 1) / 2) % n_threads];
+    }
+
 #ifdef __x86_64__
     static_assert(sizeof(struct lwan_connection) == 32,
                                         "Two connections per cache line");
@@ -640,8 +764,73 @@ schedule_client(struct lwan *l, int fd)
     static int counter = 0;
     thread = counter++ % l->thread.count;
 #endif
-    struct lwan_thread *t = &l->thread.threads[thread];
-    lwan_thread_add_client(t, fd);
+    return thread;
+}
+
+static int
+schedule_least_loaded(const struct lwan *l, int fd)
+{
+    /* Ties are broken in favor of the round-robin choice, so that the
+     * false-sharing avoidance above is kept when threads are balanced. */
+    int best = schedule_round_robin(l, fd);
+    unsigned int best_load = ATOMIC_READ(l->thread.threads[best].stats.live_connections);
+
+    for (int i = 0; i < l->thread.count && best_load; i++) {
+        unsigned int load = ATOMIC_READ(l->thread.threads[i].stats.live_connections);
+
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+static int
+schedule_power_of_two(const struct lwan *l)
+{
+    /* Only called from the main thread, so no need for a thread-safe
+     * random number generator.  Xorshift is good enough here.  */
+    static unsigned int state = 2463534242u;
+    int first, second;
+
+    if (UNLIKELY(l->thread.count == 1))
+        return 0;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    first = (int)(state % l->thread.count);
+    second = (int)((state >> 16) % (unsigned)(l->thread.count - 1));
+    if (second >= first)
+        second++;
+
+    if (ATOMIC_READ(l->thread.threads[second].stats.live_connections) <
+            ATOMIC_READ(l->thread.threads[first].stats.live_connections))
+        return second;
+    return first;
+}
+
+static ALWAYS_INLINE void
+schedule_client(struct lwan *l, int fd)
+{
+    int thread;
+
+    switch (l->config.scheduler) {
+    case SCHEDULER_LEAST_LOADED:
+        thread = schedule_least_loaded(l, fd);
+        break;
+    case SCHEDULER_POWER_OF_TWO:
+        thread = schedule_power_of_two(l);
+        break;
+    case SCHEDULER_ROUND_ROBIN:
+    default:
+        thread = schedule_round_robin(l, fd);
+    }
+
+    lwan_thread_add_client(&l->thread.threads[thread], fd);
 }
 
 static volatile sig_atomic_t main_socket = -1;
@@ -658,6 +847,31 @@ sigint_handler(int signal_number __attribute__((unused)))
     main_socket = -1;
 }
 
+static void
+wait_for_interrupt(void)
+{
+    /* Connections are being accepted by the I/O threads themselves, so
+     * there's nothing for this thread to do other than waiting for a
+     * SIGINT.  A socket pair is used in lieu of the main socket, so that
+     * the signal handler can wake this thread up the same way it would
+     * interrupt accept4().  */
+    int sv[2];
+    char byte;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        lwan_status_critical_perror("socketpair");
+
+    main_socket = sv[0];
+
+    while (read(sv[0], &byte, sizeof(byte)) < 0) {
+        if (errno != EINTR)
+            break;
+    }
+
+    lwan_status_info("Signal 2 (Interrupt) received");
+    close(sv[1]);
+}
+
 void
 lwan_main_loop(struct lwan *l)
 {
@@ -668,6 +882,11 @@ lwan_main_loop(struct lwan *l)
 
     lwan_status_info("Ready to serve");
 
+    if (l->config.per_thread_listeners) {
+        wait_for_interrupt();
+        return;
+    }
+
     for (;;) {
         int client_fd = accept4((int)main_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (UNLIKELY(client_fd < 0)) {
@@ -156,6 +156,7 @@ enum lwan_handler_flags {
     HANDLER_CAN_REWRITE_URL = 1<<7,
     HANDLER_PARSE_COOKIES = 1<<8,
     HANDLER_DATA_IS_HASH_TABLE = 1<<9,
+    HANDLER_STREAM_BODY = 1<<10,
 
     HANDLER_PARSE_MASK = 1<<0 | 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<8
 };
@@ -188,14 +189,40 @@ enum lwan_connection_flags {
     CONN_KEEP_ALIVE         = 1<<0,
     CONN_IS_ALIVE           = 1<<1,
     CONN_SHOULD_RESUME_CORO = 1<<2,
-    CONN_WRITE_EVENTS       = 1<<3,
     CONN_MUST_READ          = 1<<4,
+
+    /* What the connection is waiting for; each phase has its own timeout.
+     * The keep-alive timeout is reset on every activity; the header and
+     * body timeouts are deadlines for the whole phase, and the write
+     * timeout is only reset when some response data has been sent. */
+    CONN_PHASE_KEEP_ALIVE   = 0<<5,
+    CONN_PHASE_HEADER       = 1<<5,
+    CONN_PHASE_BODY         = 2<<5,
+    CONN_PHASE_WRITE        = 3<<5,
+    CONN_PHASE_MASK         = 3<<5,
+    CONN_PHASE_CHANGED      = 1<<7,
+
+    /* io_uring backend: a poll request for this connection is in flight */
+    CONN_POLL_ARMED         = 1<<8,
+
+    /* Readiness reported by the edge-triggered poller; cleared when a read
+     * or write would block, so the socket is only polled again after that. */
+    CONN_READABLE           = 1<<9,
+    CONN_WRITABLE           = 1<<10,
+    CONN_READY_QUEUED       = 1<<11,
+
+    /* io_uring backend: socket I/O submitted by the coroutine is in flight;
+     * the coroutine is resumed with its result */
+    CONN_IO_PENDING         = 1<<12,
 };
 
 enum lwan_connection_coro_yield {
     CONN_CORO_ABORT = -1,
     CONN_CORO_MAY_RESUME = 0,
-    CONN_CORO_FINISHED = 1
+    CONN_CORO_FINISHED = 1,
+    /* Idle between requests: coroutine can be freed, and a new one is
+     * created once there's something to read again */
+    CONN_CORO_HIBERNATE = 2
 };
 
 struct lwan_key_value {
@@ -229,7 +256,7 @@ struct lwan_connection {
     unsigned int time_to_die;
     struct coro *coro;
     struct lwan_thread *thread;
-    int prev, next; /* for death queue */
+    int prev, next; /* for timeout wheel */
 };
 
 struct lwan_proxy {
@@ -240,6 +267,34 @@ struct lwan_proxy {
 };
 
 DEFINE_ARRAY_TYPE(lwan_key_value_array, struct lwan_key_value)
+DEFINE_ARRAY_TYPE(lwan_fd_array, int)
+
+#define LWAN_KEY_VALUE_LIST_INLINE 16
+
+/* Query string, POST data, or cookies.  These are only split into pairs on
+ * the first lookup; up to LWAN_KEY_VALUE_LIST_INLINE pairs are stored
+ * inline, and more than that spill over to memory owned by the request.  */
+struct lwan_key_value_list {
+    struct lwan_value unparsed;
+    struct lwan_key_value *base;    /* NULL if not parsed yet */
+    unsigned int len, size;
+    struct lwan_key_value inline_kv[LWAN_KEY_VALUE_LIST_INLINE];
+};
+
+/* File part of a multipart/form-data body.  If the body was buffered,
+ * contents points into it; if it was streamed (HANDLER_STREAM_BODY), the
+ * part has been written to an unlinked temporary file instead.  */
+struct lwan_multipart_file {
+    const char *name;
+    const char *filename;
+    const char *content_type;
+    struct lwan_value contents;
+    int fd;                         /* -1 if not streamed */
+    off_t size;
+};
+
+struct request_parser_helper;
+struct lwan_response_batch;
 
 struct lwan_request {
     enum lwan_request_flags flags;
@@ -248,8 +303,10 @@ struct lwan_request {
     struct lwan_value original_url;
     struct lwan_connection *conn;
     struct lwan_proxy *proxy;
+    struct request_parser_helper *helper;
+    struct lwan_response_batch *batch;
 
-    struct lwan_key_value_array query_params, post_data, cookies;
+    struct lwan_key_value_list query_params, post_data, cookies;
 
     struct {
         time_t if_modified_since;
@@ -297,9 +354,26 @@ struct lwan_thread {
         time_t last;
     } date;
 
-    int epoll_fd;
+    int epoll_fd;               /* -1 if using io_uring */
+    struct lwan_uring *uring;   /* NULL if using epoll */
+    int listen_fd;
+    int cpu;                    /* -1 if not pinned */
+    unsigned short numa_node;   /* Index in lwan->thread.numa */
     int pipe_fd[2];
+    struct spsc_queue *pending_fds;
     pthread_t self;
+
+    /* Idle connections handed over by other threads */
+    pthread_mutex_t migration_lock;
+    struct lwan_fd_array migrated_fds;
+
+    struct lwan_thread_stats {
+        unsigned int live_connections;
+        unsigned long accepted_connections;
+        unsigned long migrated_connections;
+        unsigned long busy_poll_hits;   /* Events found while spinning */
+        unsigned long busy_poll_sleeps; /* Budget exhausted, had to block */
+    } stats;
 };
 
 struct lwan_straitjacket {
@@ -307,16 +381,38 @@ struct lwan_straitjacket {
     const char *chroot_path;
 };
 
+enum lwan_scheduler {
+    SCHEDULER_ROUND_ROBIN,
+    SCHEDULER_LEAST_LOADED,
+    SCHEDULER_POWER_OF_TWO,
+};
+
 struct lwan_config {
     char *listener;
     char *error_template;
     char *config_file_path;
+    char *thread_affinity;
+    char *job_thread_affinity;
     size_t max_post_data_size;
+    size_t max_request_header_size;
+    size_t coro_stack_size;
+    unsigned int coro_pool_size;
     unsigned short keep_alive_timeout;
+    unsigned short read_header_timeout;
+    unsigned short read_body_timeout;
+    unsigned short write_timeout;
+    unsigned int min_write_rate;    /* In bytes per second */
+    size_t zerocopy_threshold;      /* 0 disables MSG_ZEROCOPY */
     unsigned int expires;
+    unsigned int migration_threshold;
+    unsigned int busy_poll_budget;  /* In microseconds */
+    enum lwan_scheduler scheduler;
     unsigned short n_threads;
     bool quiet;
     bool reuse_port;
+    bool per_thread_listeners;
+    bool use_io_uring;
+    bool defer_accept;
     bool proxy_protocol;
     bool allow_cors;
     bool allow_post_temp_file;
@@ -325,12 +421,24 @@ struct lwan_config {
 struct lwan {
     struct lwan_trie url_map_trie;
     struct lwan_connection *conns;
+    size_t conns_size;
 
     struct {
         pthread_barrier_t barrier;
         struct lwan_thread *threads;
         unsigned int max_fd;
         unsigned short count;
+
+        /* Only used if threads are pinned to CPUs in more than one NUMA
+         * node.  Pages of the connection array are assigned to nodes in
+         * a round-robin fashion, and threads in node N are found in
+         * threads[first[N]] to threads[first[N + 1] - 1].  */
+        struct {
+            unsigned short count;
+            unsigned short *first;
+            unsigned short *threads;
+            unsigned int conns_per_page;
+        } numa;
     } thread;
 
     struct hash *module_registry;
@@ -352,12 +460,27 @@ const char *lwan_request_get_query_param(struct lwan_request *request, const cha
     __attribute__((warn_unused_result));
 const char * lwan_request_get_cookie(struct lwan_request *request, const char *key)
     __attribute__((warn_unused_result));
+const char *lwan_request_get_header(struct lwan_request *request, const char *header)
+    __attribute__((warn_unused_result));
+
+ssize_t lwan_request_read_body(struct lwan_request *request, void *buffer, size_t len)
+    __attribute__((warn_unused_result));
+const struct lwan_multipart_file *lwan_request_get_post_file(struct lwan_request *request, const char *name)
+    __attribute__((warn_unused_result));
+
+const struct lwan_key_value_list *lwan_request_get_post_params(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+const struct lwan_key_value_list *lwan_request_get_query_params(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+const struct lwan_key_value_list *lwan_request_get_cookies(struct lwan_request *request)
+    __attribute__((warn_unused_result));
 
 bool lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status status);
 void lwan_response_send_chunk(struct lwan_request *request);
 
 bool lwan_response_set_event_stream(struct lwan_request *request, enum lwan_http_status status);
 void lwan_response_send_event(struct lwan_request *request, const char *event);
+void lwan_response_flush(struct lwan_request *request);
 
 const char *lwan_http_status_as_string(enum lwan_http_status status)
     __attribute__((pure)) __attribute__((warn_unused_result));
@@ -376,6 +499,11 @@ void lwan_straitjacket_enforce(const struct lwan_straitjacket *sj);
 
 const struct lwan_config *lwan_get_default_config(void);
 
+/* Counters of an I/O thread, which can be read while the server runs.
+ * Returns false if there's no such thread.  */
+bool lwan_get_thread_stats(const struct lwan *l, int thread,
+    struct lwan_thread_stats *stats);
+
 int lwan_connection_get_fd(const struct lwan *lwan, const struct lwan_connection *conn)
     __attribute__((pure)) __attribute__((warn_unused_result));
 
@@ -0,0 +1,88 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+#include "lwan.h"
+#include "queue.h"
+
+int
+spsc_queue_init(struct spsc_queue *q, size_t size)
+{
+    size_t rounded = 1;
+
+    if (UNLIKELY(!size))
+        return -EINVAL;
+
+    while (rounded < size)
+        rounded <<= 1;
+
+    q->buffer = calloc(rounded, sizeof(int));
+    if (UNLIKELY(!q->buffer))
+        return -errno;
+
+    q->mask = rounded - 1;
+    q->head = q->tail = 0;
+
+    return 0;
+}
+
+void
+spsc_queue_free(struct spsc_queue *q)
+{
+    free(q->buffer);
+    q->buffer = NULL;
+}
+
+bool
+spsc_queue_push(struct spsc_queue *q, int value, bool *was_empty)
+{
+    const size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    if (UNLIKELY(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask))
+        return false;
+
+    q->buffer[tail & q->mask] = value;
+
+    /* Publishing the tail and then looking at the head (while the consumer
+     * does the opposite) must be sequentially consistent: at least one side
+     * is then guaranteed to observe the other's store, so either the
+     * consumer picks this element up in its current drain pass, or the
+     * producer sees that the queue was empty and wakes it up.  */
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    *was_empty = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == tail;
+
+    return true;
+}
+
+bool
+spsc_queue_pop(struct spsc_queue *q, int *value)
+{
+    const size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+        return false;
+
+    *value = q->buffer[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bounded, lock-free, single-producer/single-consumer queue of ints.  The
+ * producer and consumer indices live in different cache lines so that the
+ * acceptor and the I/O thread don't keep stealing the line from each other. */
+struct spsc_queue {
+    int *buffer;
+    size_t mask;
+
+    char pad0[64 - sizeof(int *) - sizeof(size_t)];
+    size_t head;                /* Only written by the consumer */
+
+    char pad1[64 - sizeof(size_t)];
+    size_t tail;                /* Only written by the producer */
+
+    char pad2[64 - sizeof(size_t)];
+};
+
+int spsc_queue_init(struct spsc_queue *q, size_t size);
+void spsc_queue_free(struct spsc_queue *q);
+
+/* Returns false if the queue is full.  Otherwise, *was_empty is set to true
+ * if the consumer had already drained every previously pushed element, in
+ * which case it must be woken up. */
+bool spsc_queue_push(struct spsc_queue *q, int value, bool *was_empty);
+bool spsc_queue_pop(struct spsc_queue *q, int *value);
@@ -299,3 +299,21 @@ strbuf_reset(struct strbuf *s)
 
     return true;
 }
+
+char *
+strbuf_detach(struct strbuf *s)
+{
+    char *buffer;
+
+    /* Static buffers aren't owned by the strbuf */
+    if (s->flags & STATIC)
+        return NULL;
+
+    buffer = s->value.buffer;
+
+    s->flags |= STATIC;
+    s->value.static_buffer = "";
+    s->len.allocated = s->len.buffer = 0;
+
+    return buffer;
+}
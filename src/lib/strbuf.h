@@ -52,6 +52,8 @@ bool		 strbuf_printf(struct strbuf *s1, const char *fmt, ...);
 
 bool		 strbuf_grow_to(struct strbuf *s, size_t new_size);
 
+char		*strbuf_detach(struct strbuf *s);
+
 #define strbuf_get_length(s)	(((struct strbuf *)(s))->len.buffer)
 #define strbuf_get_buffer(s)	(((struct strbuf *)(s))->value.buffer)
 
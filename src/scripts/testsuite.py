@@ -22,10 +22,13 @@ for arg in sys.argv[1:]:
 print('Using', LWAN_PATH, 'for lwan')
 
 class LwanTest(unittest.TestCase):
+  # Configuration file to use instead of testrunner.conf
+  config_file = None
+
   def setUp(self):
     for spawn_try in range(20):
       self.lwan=subprocess.Popen(
-        [LWAN_PATH],
+        [LWAN_PATH] + ([self.config_file] if self.config_file else []),
         stdout=subprocess.PIPE, stderr=subprocess.STDOUT
       )
       for request_try in range(20):
@@ -89,6 +92,83 @@ class TestPost(LwanTest):
   def test_medium_request(self): self.make_request_with_size(100)
   def test_large_request(self): self.make_request_with_size(1000)
 
+  def make_streamed_request_with_size(self, size):
+    data = "tro" + "lo" * size
+
+    r = requests.post('http://127.0.0.1:8080/post/stream', data=data)
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {
+      'received': len(data),
+      'sum': sum(ord(b) for b in data)
+    })
+
+  def test_small_streamed_request(self): self.make_streamed_request_with_size(10)
+  # Larger than max_post_data_size, which doesn't apply to streamed bodies
+  def test_huge_streamed_request(self): self.make_streamed_request_with_size(1000000)
+
+  def make_chunked_request(self, url, data):
+    # Generators are sent with "Transfer-Encoding: chunked"
+    def chunks():
+      for i in range(0, len(data), 4093):
+        yield data[i:i + 4093].encode()
+
+    r = requests.post(url, data=chunks(),
+      headers={'Content-Type': 'x-test/trololo'})
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {
+      'received': len(data),
+      'sum': sum(ord(b) for b in data)
+    })
+
+  def test_chunked_request(self):
+    self.make_chunked_request('http://127.0.0.1:8080/post/big', "tro" + "lo" * 20000)
+
+  # Same limit as with Content-Length: max_post_data_size is 1000000
+  def test_chunked_request_of_max_size(self):
+    self.make_chunked_request('http://127.0.0.1:8080/post/big', "tro" + "lo" * 499998 + "l")
+
+  def test_chunked_streamed_request(self):
+    self.make_chunked_request('http://127.0.0.1:8080/post/stream', "tro" + "lo" * 1000000)
+
+  def make_upload_request(self, url, contents):
+    r = requests.post(url, data={'field': 'trololo'},
+      files={'file': ('upload.bin', contents, 'application/x-test')})
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {
+      'field': 'trololo',
+      'filename': 'upload.bin',
+      'content_type': 'application/x-test',
+      'size': len(contents),
+      'sum': sum(bytearray(contents))
+    })
+
+  # Part header line ending in a bare CR
+  def make_malformed_upload_request(self, url):
+    body = (b'--xyz\r\n'
+      b'Content-Disposition: form-data; name="field"\r\r\n\r\n'
+      b'trololo\r\n--xyz--\r\n')
+    r = requests.post(url, data=body,
+      headers={'Content-Type': 'multipart/form-data; boundary=xyz'})
+
+    self.assertEqual(r.status_code, 400)
+
+    r = requests.get('http://127.0.0.1:8080/hello')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+
+  def test_buffered_upload(self):
+    self.make_upload_request('http://127.0.0.1:8080/post/upload-buffered',
+      bytes(bytearray(i % 251 for i in range(50000))))
+    self.make_malformed_upload_request('http://127.0.0.1:8080/post/upload-buffered')
+
+  # Larger than max_post_data_size, and with bytes that look like a delimiter
+  def test_streamed_upload(self):
+    self.make_upload_request('http://127.0.0.1:8080/post/upload',
+      b'\r\n--' + bytes(bytearray(i % 253 for i in range(1500000))) + b'\r\n-')
+    self.make_malformed_upload_request('http://127.0.0.1:8080/post/upload')
+
   # These two tests are supposed to fail, with Lwan aborting the connection.
   def test_huge_request(self):
     try:
@@ -390,6 +470,23 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+  # More chunks than fit in the output buffer at once
+  def test_many_chunks(self):
+    r = requests.get('http://localhost:8080/chunked-many')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+    self.assertEqual(r.text, ''.join('%d,' % i for i in range(2000)))
+
+  def test_server_sent_events(self):
+    expected = ''.join('event: currval\r\ndata: Current value is %d\r\n\r\n' % i
+      for i in range(11))
+
+    # Event streams don't end until the connection is closed
+    r = requests.get('http://localhost:8080/sse', stream=True)
+    self.assertHttpResponseValid(r, 200, 'text/event-stream')
+    self.assertEqual(r.raw.read(len(expected)).decode(), expected)
+    r.close()
+
 class TestLua(LwanTest):
   def test_inline(self):
     r = requests.get('http://localhost:8080/inline')
@@ -462,6 +559,14 @@ class TestAuthentication(LwanTest):
 
 
 class TestHelloWorld(LwanTest):
+  def test_huge_headers(self):
+    r = requests.get('http://127.0.0.1:8080/huge-headers')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Huge headers')
+    self.assertEqual(r.headers['Content-Security-Policy'], 'x' * 2999)
+    self.assertEqual(r.headers['Set-Cookie'], 'trololo=1')
+
   def test_cookies(self):
     c = {
         'SOMECOOKIE': '1c330301-89e4-408a-bf6c-ce107efe8a27',
@@ -476,6 +581,29 @@ class TestHelloWorld(LwanTest):
     for k, v in list(c.items()):
       self.assertTrue('Key = "%s"; Value = "%s"\n' % (k, v) in r.text)
 
+  def test_large_cookie(self):
+    c = {'LARGECOOKIE': 'x' * 20000}
+    r = requests.get('http://127.0.0.1:8080/hello?dump_vars=1', cookies=c)
+
+    self.assertResponsePlain(r)
+    self.assertTrue('Key = "LARGECOOKIE"; Value = "%s"\n' % c['LARGECOOKIE'] in r.text)
+
+  def test_get_header(self):
+    headers = {
+      'User-Agent': 'lwan-testsuite',
+      'X-Forwarded-For': '192.0.2.1',
+      'X-Not-Well-Known': 'some value',
+    }
+    for name, value in headers.items():
+      r = requests.get('http://127.0.0.1:8080/header?name=' + name.lower(),
+                       headers=headers)
+
+      self.assertResponsePlain(r)
+      self.assertEqual(r.text, value)
+
+    r = requests.get('http://127.0.0.1:8080/header?name=If-None-Match')
+    self.assertEqual(r.status_code, 404)
+
   def test_head_request_hello(self):
     r = requests.head('http://127.0.0.1:8080/hello',
           headers={'Accept-Encoding': 'foobar'})
@@ -517,6 +645,17 @@ class TestHelloWorld(LwanTest):
     self.assertTrue('Key = "name"; Value = "testsuite"\n' in r.text)
 
 
+  def test_with_many_params(self):
+    params = '&'.join('key%d=value%d' % (i, i) for i in range(40))
+    r = requests.get('http://127.0.0.1:8080/hello?%s&name=testsuite&dump_vars=1' % params)
+
+    self.assertResponsePlain(r)
+
+    self.assertTrue(r.text.startswith('Hello, testsuite!'))
+    for i in range(40):
+      self.assertTrue('Key = "key%d"; Value = "value%d"\n' % (i, i) in r.text)
+
+
   def test_with_param(self):
     r = requests.get('http://127.0.0.1:8080/hello?name=testsuite')
 
@@ -555,6 +694,17 @@ class TestHelloWorld(LwanTest):
       self.assertTrue('Key = "%s"; Value = "%s"\n' % (k, v) in r.text)
 
 
+class TestThreadStats(LwanTest):
+  def test_thread_stats(self):
+    r = requests.get('http://127.0.0.1:8080/thread-stats')
+
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    stats = re.findall(r'thread \d+: live (\d+), accepted (\d+), migrated (\d+)', r.text)
+    self.assertTrue(stats)
+    self.assertTrue(sum(int(live) for live, _, _ in stats) >= 1)
+    self.assertTrue(sum(int(accepted) for _, accepted, _ in stats) >= 2)
+
+
 class TestCache(LwanTest):
   def mmaps(self, f):
     with open('/proc/%d/maps' % self.lwan.pid) as map_file:
@@ -652,10 +802,322 @@ Host: 192.168.0.11\r\n\r\n'''
         self.assertTrue(response.startswith('HTTP/1.1 200 OK'), response)
         self.assertTrue('X-Proxy: 1.2.3.4' in response, response)
 
+class TestExpectContinue(SocketTest):
+  def send_after_continue(self, url, body):
+    req = 'POST %s HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Type: x-test/trololo\r\nContent-Length: %d\r\n\r\n' % (url, len(body))
+
+    with self.connect() as sock:
+      sock.send(req)
+      self.assertEqual(sock.recv(4096), 'HTTP/1.1 100 Continue\r\n\r\n')
+
+      sock.send(body)
+      response = ''
+      while not response.endswith('}'):
+        data = sock.recv(4096)
+        if not data:
+          break
+        response += data
+
+    self.assertTrue(response.startswith('HTTP/1.1 200 OK'), response)
+    self.assertTrue(response.endswith('{"received": %d, "sum": %d}' %
+      (len(body), sum(ord(b) for b in body))), response)
+
+  def test_buffered_body(self):
+    self.send_after_continue('/post/big', 'tro' + 'lo' * 1000)
+
+  def test_streamed_body(self):
+    self.send_after_continue('/post/stream', 'tro' + 'lo' * 100000)
+
+  def test_body_too_large(self):
+    req = 'POST /post/big HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Length: 2000000\r\n\r\n'
+
+    with self.connect() as sock:
+      sock.send(req)
+      response = sock.recv(4096)
+
+    self.assertTrue(response.startswith('HTTP/1.1 413 '), response)
+    self.assertTrue('Connection: keep-alive' not in response, response)
+
+class TestMigration(SocketTest):
+  config_file = 'testrunner-migration.conf'
+
+  def get_thread_stats(self, sock):
+    sock.sendall(b'GET /thread-stats HTTP/1.1\r\nHost: localhost\r\n\r\n')
+
+    response = b''
+    while b'\r\n\r\n' not in response:
+      response += sock.recv(4096)
+    headers, body = response.split(b'\r\n\r\n', 1)
+    length = int(re.search(rb'Content-Length: (\d+)', headers).group(1))
+    while len(body) < length:
+      body += sock.recv(4096)
+
+    return body
+
+  def get_live_connections(self, sock):
+    stats = self.get_thread_stats(sock)
+    return [int(live) for live in re.findall(rb'live (\d+)', stats)]
+
+  def connect_and_find_thread(self, stats_sock):
+    before = self.get_live_connections(stats_sock)
+    sock = socket.create_connection(('127.0.0.1', 8080))
+
+    for _ in range(50):
+      after = self.get_live_connections(stats_sock)
+      for thread, (b, a) in enumerate(zip(before, after)):
+        if a > b:
+          return sock, thread
+      time.sleep(0.01)
+
+    raise Exception('Connection was not accepted')
+
+  # Idle connections are moved to less loaded threads; ones with pipelined
+  # requests waiting to be handled can't be.
+  def test_pipelined_requests(self):
+    stats_sock = socket.create_connection(('127.0.0.1', 8080))
+    others = []
+
+    # The connection used for the stats is idle most of the time too, so
+    # keep it out of the thread that is going to be the busiest one
+    for _ in range(50):
+      live = self.get_live_connections(stats_sock)
+      if sum(live) == 1:
+        break
+      time.sleep(0.01)
+    stats_thread = live.index(1)
+
+    while True:
+      sock, thread = self.connect_and_find_thread(stats_sock)
+      if thread != stats_thread:
+        break
+      sock.close()
+
+    try:
+      # Make the thread handling the pipelined requests the busiest one
+      same_thread = 0
+      while same_thread < 3:
+        other, other_thread = self.connect_and_find_thread(stats_sock)
+        if other_thread == thread:
+          same_thread += 1
+          others.append(other)
+        else:
+          others.insert(0, other)
+      for other in others[:-same_thread]:
+        other.close()
+      others = others[-same_thread:]
+      time.sleep(0.5)
+
+      req = b'GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n'
+      sock.settimeout(10)
+      sock.sendall(req * 3)
+
+      data = b''
+      while b'\r\n\r\n' not in data:
+        data += sock.recv(4096)
+      headers = data.split(b'\r\n\r\n', 1)[0]
+      self.assertTrue(headers.startswith(b'HTTP/1.1 200 '))
+      response_len = len(headers) + 4 + 4 * 1024 * 1024
+
+      received = len(data)
+      while received < 3 * response_len:
+        data = sock.recv(1 << 20)
+        if not data:
+          break
+        received += len(data)
+
+      self.assertEqual(received, 3 * response_len)
+
+      # Once idle, it's moved to the other thread
+      time.sleep(0.5)
+      stats = self.get_thread_stats(stats_sock)
+      migrated = re.findall(rb'migrated (\d+)', stats)
+      self.assertEqual(int(migrated[thread]), 1)
+    finally:
+      for other in others:
+        other.close()
+      sock.close()
+      stats_sock.close()
+
+
+class TestIoUring(SocketTest):
+  config_file = 'testrunner-io-uring.conf'
+
+  def recv_responses(self, sock, n_responses):
+    data = b''
+    responses = []
+
+    while len(responses) < n_responses:
+      while b'\r\n\r\n' not in data:
+        received = sock.recv(4096)
+        self.assertTrue(received)
+        data += received
+      headers, data = data.split(b'\r\n\r\n', 1)
+
+      length = int(re.search(rb'Content-Length: (\d+)', headers).group(1))
+      while len(data) < length:
+        received = sock.recv(1 << 20)
+        self.assertTrue(received)
+        data += received
+
+      responses.append((headers, data[:length]))
+      data = data[length:]
+
+    return responses
+
+  # Files are spliced through a pipe instead of using sendfile()
+  def test_file(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Accept-Encoding': 'foobar'})
+
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertEqual(r.text, '\0' * 32768)
+
+  # Larger than the socket buffer: send requests complete partially, and
+  # the rest is submitted again
+  def test_big_responses(self):
+    body = bytes(ord('a') + i % 26 for i in range(4 * 1024 * 1024))
+
+    with socket.create_connection(('127.0.0.1', 8080)) as sock:
+      sock.settimeout(10)
+      sock.sendall(b'GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n' * 2)
+
+      for headers, received in self.recv_responses(sock, 2):
+        self.assertTrue(headers.startswith(b'HTTP/1.1 200 '))
+        self.assertEqual(received, body)
+
+  # Nothing to read when the rest of the body is needed: a receive request
+  # is submitted, and completes once the client sends it
+  def test_body_sent_later(self):
+    body = b'tro' + b'lo' * 20000
+    req = b'POST /post/big HTTP/1.1\r\nHost: localhost\r\n'
+    req += b'Content-Type: x-test/trololo\r\n'
+    req += b'Content-Length: %d\r\n\r\n' % len(body)
+
+    with socket.create_connection(('127.0.0.1', 8080)) as sock:
+      sock.settimeout(10)
+      sock.sendall(req + body[:1000])
+      time.sleep(0.2)
+      sock.sendall(body[1000:])
+
+      [(headers, received)] = self.recv_responses(sock, 1)
+      self.assertTrue(headers.startswith(b'HTTP/1.1 200 '))
+      self.assertEqual(received,
+        b'{"received": %d, "sum": %d}' % (len(body), sum(body)))
+
+  def test_pipelined_requests(self):
+    req = b'GET /hello?name=%d HTTP/1.1\r\nHost: localhost\r\n\r\n'
+
+    with socket.create_connection(('127.0.0.1', 8080)) as sock:
+      sock.settimeout(10)
+      sock.sendall(b''.join(req % i for i in range(16)))
+
+      responses = self.recv_responses(sock, 16)
+
+    for i, (headers, received) in enumerate(responses):
+      self.assertTrue(headers.startswith(b'HTTP/1.1 200 '))
+      self.assertEqual(received, b'Hello, %d!' % i)
+
+
+class TestTimeouts(SocketTest):
+  config_file = 'testrunner-timeouts.conf'
+
+  # Clients that connect and send nothing are given read_header_timeout,
+  # not keep_alive_timeout
+  def test_header_timeout_after_accept(self):
+    with self.connect() as sock:
+      sock.settimeout(10)
+      start = time.time()
+      self.assertEqual(sock.recv(4096), '')
+
+    self.assertLess(time.time() - start, 10)
+
+  def test_keep_alive_timeout_after_request(self):
+    with self.connect() as sock:
+      sock.settimeout(10)
+      sock.send('GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      self.assertTrue(sock.recv(4096).startswith('HTTP/1.1 200 '))
+
+      time.sleep(3)
+
+      sock.send('GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      self.assertTrue(sock.recv(4096).startswith('HTTP/1.1 200 '))
+
+
+class TestWriteRate(SocketTest):
+  config_file = 'testrunner-write-rate.conf'
+
+  def connect_with_small_buffer(self):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.connect(('127.0.0.1', 8080))
+    sock.settimeout(10)
+    return sock
+
+  # Events far apart aren't taken as a slow client once one of them fills
+  # the socket buffer for a moment.  The server sends the next event once
+  # it gets a byte of the request body.
+  def test_slow_event_stream(self):
+    with self.connect_with_small_buffer() as sock:
+      sock.sendall(b'POST /slow-sse HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3\r\n\r\n')
+
+      data = bytearray()
+      for i in range(3):
+        while data.count(b'event: currval') <= i:
+          received = sock.recv(4096)
+          self.assertTrue(received)
+          data += received
+
+        time.sleep(0.7)
+        sock.sendall(b'x')
+
+      while b'event: big' not in data:
+        received = sock.recv(4096)
+        self.assertTrue(received)
+        data += received
+
+      time.sleep(0.3)
+
+      while b'event: done' not in data[-64:]:
+        received = sock.recv(1 << 20)
+        self.assertTrue(received)
+        data += received
+
+    self.assertTrue(data.startswith(b'HTTP/1.1 200 '))
+    self.assertEqual(data.count(b'event: currval'), 3)
+
+  # Clients that make room for a response slower than min_write_rate are
+  # disconnected once it has waited for them for write_timeout seconds
+  def test_slow_reader(self):
+    with self.connect_with_small_buffer() as sock:
+      sock.sendall(b'GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n')
+
+      received = 0
+      for _ in range(40):
+        received += len(sock.recv(1024))
+        time.sleep(0.05)
+
+      while True:
+        try:
+          data = sock.recv(1 << 20)
+        except ConnectionResetError:
+          break
+        if not data:
+          break
+        received += len(data)
+
+    self.assertLess(received, 4 * 1024 * 1024)
+
+
 class TestPipelinedRequests(SocketTest):
   def test_pipelined_requests(self):
+    self.assertPipelinedRequests(16)
+
+  def test_pipelined_requests_larger_than_buffer(self):
+    self.assertPipelinedRequests(64)
+
+  def assertPipelinedRequests(self, n_requests):
     response_separator = re.compile('\r\n\r\n')
-    names = ['name%04x' % x for x in range(16)]
+    names = ['name%04x' % x for x in range(n_requests)]
     reqs = '\r\n\r\n'.join('''GET /hello?name=%s HTTP/1.1\r
 Host: localhost\r
 Connection: keep-alive\r
@@ -666,7 +1128,8 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       sock.send(reqs)
 
       responses = ''
-      while len(response_separator.findall(responses)) != 16:
+      while len(response_separator.findall(responses)) != n_requests or \
+            not responses.endswith('Hello, %s!' % names[-1]):
         response = sock.recv(32)
         if response:
           responses += response
@@ -678,6 +1141,87 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       self.assertTrue(s in responses)
       responses = responses.replace(s, '')
 
+  def test_partially_sent_pipelined_request(self):
+    req = 'GET /hello?name=%s HTTP/1.1\r\nHost: localhost\r\n\r\n'
+
+    with self.connect() as sock:
+      sock.send(req % 'first' + (req % 'second')[:20])
+      time.sleep(0.1)
+      sock.send((req % 'second')[20:])
+
+      responses = ''
+      while 'Hello, second!' not in responses:
+        response = sock.recv(4096)
+        if not response:
+          break
+        responses += response
+
+    self.assertTrue('Hello, first!' in responses)
+    self.assertTrue('Hello, second!' in responses)
+
+  def test_pipelined_request_after_unwanted_body(self):
+    body = 'x' * 10000
+    req = 'POST /brew-coffee HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n%s' % (len(body), body)
+    req += 'GET /hello?name=after HTTP/1.1\r\nHost: localhost\r\n\r\n'
+
+    with self.connect() as sock:
+      sock.send(req)
+
+      responses = ''
+      while 'Hello, after!' not in responses:
+        response = sock.recv(4096)
+        if not response:
+          break
+        responses += response
+
+    self.assertTrue(responses.startswith('HTTP/1.1 405 '))
+    self.assertTrue('Hello, after!' in responses)
+
+  def test_pipelined_request_after_chunked_body(self):
+    req = 'POST /post/stream HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n'
+    req += '5;ext=1\r\ntrolo\r\n1a\r\nlololololololololololololo\r\n0\r\nX-Trailer: 1\r\n\r\n'
+    req += 'GET /hello?name=after HTTP/1.1\r\nHost: localhost\r\n\r\n'
+
+    with self.connect() as sock:
+      sock.send(req)
+
+      responses = ''
+      while 'Hello, after!' not in responses:
+        response = sock.recv(4096)
+        if not response:
+          break
+        responses += response
+
+    self.assertTrue('{"received": 31, "sum": %d}' % sum(ord(b) for b in 'trolo' + 'lo' * 13) in responses)
+    self.assertTrue('Hello, after!' in responses)
+
+  def test_request_smuggled_in_body_is_not_answered(self):
+    smuggled = 'GET /hello?name=SMUGGLED HTTP/1.1\r\n\r\n'
+
+    framings = (
+      ('Transfer-Encoding: chunked\r\nContent-Length: %d\r\n' % len(smuggled), '400'),
+      ('Transfer-Encoding: gzip\r\n', '501'),
+    )
+
+    for framing, status in framings:
+      req = 'POST /hello HTTP/1.1\r\nHost: localhost\r\n' + framing + '\r\n'
+      req += smuggled
+
+      with self.connect() as sock:
+        sock.send(req)
+
+        responses = ''
+        while True:
+          response = sock.recv(4096)
+          if not response:
+            break
+          responses += response
+
+      self.assertTrue(responses.startswith('HTTP/1.1 %s ' % status))
+      self.assertTrue('Connection: close' in responses)
+      self.assertFalse('SMUGGLED' in responses)
+      self.assertEqual(responses.count('HTTP/1.1 '), 1)
+
 class TestArtificialResponse(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/brew-coffee')